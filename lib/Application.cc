@@ -293,7 +293,16 @@ void bt::Application::run(void) {
   shutdown();
 }
 
+namespace bt {
+  // defined in Pen.cc
+  void releaseXftDraw(Drawable drawable);
+  void forgetXftDraw(Drawable drawable);
+}
+
 void bt::Application::process_event(XEvent *event) {
+  if (event->type == DestroyNotify)
+    forgetXftDraw(event->xdestroywindow.window);
+
   bt::EventHandler *handler = findEventHandler(event->xany.window);
   if (!handler)
     return;
@@ -581,6 +590,8 @@ void bt::Application::insertEventHandler(Window window,
 
 
 void bt::Application::removeEventHandler(Window window) {
+  // windows are destroyed right after their handler is removed
+  releaseXftDraw(window);
   eventhandlers.erase(window);
 }
 
@@ -26,6 +26,7 @@
 #include "Display.hh"
 
 #include <map>
+#include <vector>
 
 #include <X11/Xlib.h>
 
@@ -56,6 +57,11 @@ namespace bt {
       be freed by calling clear().
     */
     void release(unsigned int screen, int r, int g, int b);
+    /*
+      Adds a reference to an rgb that was already found on the given
+      screen.  This is used when copying colors.
+    */
+    void retain(unsigned int screen, int r, int g, int b);
 
     /*
       Clears the color cache.  All colors with a zero reference count
@@ -69,6 +75,28 @@ namespace bt {
   private:
     const Display &_display;
 
+    /*
+      On TrueColor visuals the pixel is the scaled rgb shifted into
+      place, so there is no need to ask the server or to count
+      references.  The scaling rounds to the nearest value, which is
+      what the server does for the linear maps of TrueColor visuals.
+    */
+    struct TrueColorFormat {
+      bool enabled;
+      unsigned int red_max, green_max, blue_max;
+      unsigned int red_shift, green_shift, blue_shift;
+
+      inline unsigned long pixel(int r, int g, int b) const {
+        r &= 0xff;
+        g &= 0xff;
+        b &= 0xff;
+        return (((r * red_max + 127) / 255) << red_shift
+                | ((g * green_max + 127) / 255) << green_shift
+                | ((b * blue_max + 127) / 255) << blue_shift);
+      }
+    };
+    std::vector<TrueColorFormat> formats;
+
     struct RGB {
       const unsigned int screen;
       const int r, g, b;
@@ -128,9 +156,40 @@ namespace bt {
 } // namespace bt
 
 
+static void splitMask(unsigned long mask,
+                      unsigned int &max, unsigned int &shift) {
+  shift = 0u;
+  if (mask == 0ul) {
+    max = 0u;
+    return;
+  }
+  while (!(mask & 1ul)) {
+    mask >>= 1;
+    ++shift;
+  }
+  max = static_cast<unsigned int>(mask);
+}
+
+
 bt::ColorCache::ColorCache(const Display &display)
-  : _display(display)
-{ }
+  : _display(display), formats(ScreenCount(display.XDisplay()))
+{
+  /*
+    formats are indexed by screen number.  in single-head mode only
+    one screen is managed, and it need not be screen 0, so the others
+    are left disabled.
+  */
+  for (unsigned int screen = 0; screen < formats.size(); ++screen) {
+    const ScreenInfo &screeninfo = _display.screenInfo(screen);
+    const Visual * const visual = screeninfo.visual();
+    TrueColorFormat &format = formats[screen];
+    format.enabled = (screeninfo.screenNumber() == screen
+                      && visual->c_class == TrueColor);
+    splitMask(visual->red_mask, format.red_max, format.red_shift);
+    splitMask(visual->green_mask, format.green_max, format.green_shift);
+    splitMask(visual->blue_mask, format.blue_max, format.blue_shift);
+  }
+}
 
 
 bt::ColorCache::~ColorCache(void)
@@ -145,6 +204,9 @@ unsigned long bt::ColorCache::find(unsigned int screen, int r, int g, int b) {
   if (b < 0 && b > 255)
     b = 0;
 
+  if (formats[screen].enabled)
+    return formats[screen].pixel(r, g, b);
+
   // see if we have allocated this color before
   RGB rgb(screen, r, g, b);
   Cache::iterator it = cache.find(rgb);
@@ -194,6 +256,9 @@ void bt::ColorCache::release(unsigned int screen, int r, int g, int b) {
   if (b < 0 && b > 255)
     b = 0;
 
+  if (formats[screen].enabled)
+    return;
+
   RGB rgb(screen, r, g, b);
   Cache::iterator it = cache.find(rgb);
 
@@ -207,6 +272,30 @@ void bt::ColorCache::release(unsigned int screen, int r, int g, int b) {
 }
 
 
+void bt::ColorCache::retain(unsigned int screen, int r, int g, int b) {
+  if (r < 0 && r > 255)
+    r = 0;
+  if (g < 0 && g > 255)
+    g = 0;
+  if (b < 0 && b > 255)
+    b = 0;
+
+  if (formats[screen].enabled)
+    return;
+
+  RGB rgb(screen, r, g, b);
+  Cache::iterator it = cache.find(rgb);
+
+  assert(it != cache.end() && it->second.count > 0);
+  ++it->second.count;
+
+#ifdef COLORCACHE_DEBUG
+  fprintf(stderr, "bt::ColorCache: ret %02x/%02x/%02x, count %4u\n",
+          r, g, b, it->second.count);
+#endif // COLORCACHE_DEBUG
+}
+
+
 void bt::ColorCache::clear(bool force) {
   Cache::iterator it = cache.begin();
   if (it == cache.end())
@@ -303,6 +392,16 @@ unsigned long bt::Color::pixel(unsigned int screen) const {
 }
 
 
+void bt::Color::copyPixel(const Color &c) {
+  assert(colorcache != 0);
+  assert(_screen == ~0u && c._screen != ~0u);
+  colorcache->retain(c._screen, _red, _green, _blue);
+
+  _screen = c._screen;
+  _pixel = c._pixel;
+}
+
+
 void bt::Color::deallocate(void) {
   if (_screen == ~0u)
     return; // not allocated
@@ -36,7 +36,7 @@ namespace bt {
   /*
     The color object.  Colors are stored in rgb format (screen
     independent).  Screen dependent pixel values can be obtained using
-    the pixel() function.
+    the pixel() function.  Copies keep the pixel of the original.
   */
   class Color {
   public:
@@ -59,7 +59,7 @@ namespace bt {
     inline Color(const Color &c)
       : _red(c._red), _green(c._green), _blue(c._blue),
         _screen(~0u), _pixel(0ul)
-    { }
+    { if (c._screen != ~0u) copyPixel(c); }
     inline ~Color(void)
     { deallocate(); }
 
@@ -78,14 +78,22 @@ namespace bt {
     { return _red != -1 && _green != -1 && _blue != -1; }
 
     // operators
-    inline Color &operator=(const Color &c)
-    { setRGB(c._red, c._green, c._blue); return *this; }
+    inline Color &operator=(const Color &c) {
+      if (this != &c) {
+        setRGB(c._red, c._green, c._blue);
+        if (c._screen != ~0u)
+          copyPixel(c);
+      }
+      return *this;
+    }
     inline bool operator==(const Color &c) const
     { return _red == c._red && _green == c._green && _blue == c._blue; }
     inline bool operator!=(const Color &c) const
     { return !operator==(c); }
 
   private:
+    // shares the pixel allocated by c, which has the same rgb
+    void copyPixel(const Color &c);
     void deallocate(void);
 
     int _red, _green, _blue;
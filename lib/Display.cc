@@ -60,8 +60,19 @@ namespace bt {
 
 #ifdef    MITSHM
   void startupShm(const Display &display);
+  void shutdownShm(const Display &display);
 #endif // MITSHM
 
+
+#ifdef    THREADS
+  void destroyWorkerPool(void);
+#endif // THREADS
+
+
+#ifdef    XRENDER
+  void startupXRender(const Display &display);
+#endif // XRENDER
+
 } // namespace bt
 
 
@@ -100,10 +111,22 @@ bt::Display::Display(const char *dpy_name, bool multi_head) {
 #ifdef    MITSHM
   startupShm(*this);
 #endif // MITSHM
+
+#ifdef    XRENDER
+  startupXRender(*this);
+#endif // XRENDER
 }
 
 
 bt::Display::~Display() {
+#ifdef    MITSHM
+  shutdownShm(*this);
+#endif // MITSHM
+
+#ifdef    THREADS
+  destroyWorkerPool();
+#endif // THREADS
+
   destroyColorTables();
   destroyPixmapCache();
   destroyPenLoader();
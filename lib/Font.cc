@@ -28,6 +28,8 @@
 #include "Pen.hh"
 #include "Resource.hh"
 
+#include <algorithm>
+#include <list>
 #include <map>
 #include <vector>
 
@@ -66,6 +68,48 @@ namespace bt {
 
     void clear(bool force);
 
+    /*
+      Text extents are kept for the most recently measured strings,
+      keyed by the XftFont or XFontSet and the text.  Returns true and
+      sets rect if the text was found.
+    */
+    bool findExtents(const void *font, const ustring &text, Rect &rect);
+    void addExtents(const void *font, const ustring &text, const Rect &rect);
+    // forgets all extents measured with the font, called before unloading
+    void releaseExtents(const void *font);
+
+    enum {
+      // strings kept in the extent cache
+      MaximumExtents = 512u
+    };
+
+#ifdef XFT
+    /*
+      Glyph metrics are kept per XftFont (and so per screen) in pages
+      of 256 characters covering the BMP.  Each glyph is measured the
+      first time it is used, after that strings can be measured
+      without asking Xft.
+    */
+    struct GlyphMetrics {
+      short x, width, xoff;
+      bool known;
+    };
+    enum {
+      GlyphPageSize = 256u,
+      GlyphPages = 256u
+    };
+
+    /*
+      Returns the metrics for c, or 0 if c is outside the table.
+    */
+    const GlyphMetrics *findGlyph(XftFont *font, Uchar c);
+    void releaseGlyphs(XftFont *font);
+
+    typedef std::vector<GlyphMetrics *> GlyphTable;
+    typedef std::map<XftFont *, GlyphTable> GlyphTables;
+    GlyphTables glyph_tables;
+#endif
+
     const Display &_display;
 #ifdef XFT
     bool xft_initialized;
@@ -108,6 +152,26 @@ namespace bt {
     typedef std::map<FontName,FontRef> Cache;
     typedef Cache::value_type CacheItem;
     Cache cache;
+
+    struct ExtentKey {
+      const void * const font;
+      const ustring text;
+      inline ExtentKey(const void *f, const ustring &t)
+        : font(f), text(t)
+      { }
+      inline bool operator<(const ExtentKey &other) const {
+        if (font != other.font)
+          return font < other.font;
+        return text < other.text;
+      }
+    };
+
+    // most recently used first
+    typedef std::list<std::pair<ExtentKey, Rect> > ExtentList;
+    typedef std::map<ExtentKey, ExtentList::iterator> ExtentCache;
+    ExtentList extent_list;
+    ExtentCache extent_cache;
+    unsigned long extent_hits, extent_misses;
   };
 
 
@@ -172,7 +236,7 @@ namespace bt {
 
 
 bt::FontCache::FontCache(const Display &dpy)
-  : _display(dpy)
+  : _display(dpy), extent_hits(0ul), extent_misses(0ul)
 {
 #ifdef XFT
   xft_initialized = XftInit(NULL) && XftInitFtLibrary();
@@ -376,6 +440,15 @@ void bt::FontCache::clear(bool force) {
     fprintf(stderr, "bt::FontCache: fre      '%s'\n", it->first.name.c_str());
 #endif // FONTCACHE_DEBUG
 
+    if (it->second.fontset)
+      releaseExtents(it->second.fontset);
+    if (it->second.xftfont) {
+      releaseExtents(it->second.xftfont);
+#ifdef XFT
+      releaseGlyphs(it->second.xftfont);
+#endif
+    }
+
     if (it->second.fontset)
       XFreeFontSet(_display.XDisplay(), it->second.fontset);
 #ifdef XFT
@@ -389,10 +462,127 @@ void bt::FontCache::clear(bool force) {
 
 #ifdef FONTCACHE_DEBUG
   fprintf(stderr, "bt::FontCache: cleared, %u entries remain\n", cache.size());
+  fprintf(stderr, "bt::FontCache: extents %lu hits, %lu misses, %u kept\n",
+          extent_hits, extent_misses, extent_cache.size());
 #endif // FONTCACHE_DEBUG
 }
 
 
+bool bt::FontCache::findExtents(const void *font, const ustring &text,
+                                Rect &rect) {
+  ExtentCache::iterator it = extent_cache.find(ExtentKey(font, text));
+  if (it == extent_cache.end()) {
+    ++extent_misses;
+    return false;
+  }
+
+  ++extent_hits;
+  // move to the front of the list
+  extent_list.splice(extent_list.begin(), extent_list, it->second);
+  rect = it->second->second;
+  return true;
+}
+
+
+void bt::FontCache::addExtents(const void *font, const ustring &text,
+                               const Rect &rect) {
+  if (extent_cache.size() >= MaximumExtents) {
+    // drop the least recently used string
+    extent_cache.erase(extent_list.back().first);
+    extent_list.pop_back();
+  }
+
+  const ExtentKey key(font, text);
+  extent_list.push_front(ExtentList::value_type(key, rect));
+  extent_cache.insert(ExtentCache::value_type(key, extent_list.begin()));
+}
+
+
+void bt::FontCache::releaseExtents(const void *font) {
+  ExtentList::iterator it = extent_list.begin();
+  while (it != extent_list.end()) {
+    if (it->first.font != font) {
+      ++it;
+      continue;
+    }
+    extent_cache.erase(it->first);
+    it = extent_list.erase(it);
+  }
+}
+
+
+#ifdef XFT
+const bt::FontCache::GlyphMetrics *
+bt::FontCache::findGlyph(XftFont *font, Uchar c) {
+  if (c >= GlyphPages * GlyphPageSize)
+    return 0;
+
+  GlyphTable &table = glyph_tables[font];
+  if (table.empty())
+    table.resize(GlyphPages, 0);
+
+  GlyphMetrics *&page = table[c / GlyphPageSize];
+  if (!page) {
+    page = new GlyphMetrics[GlyphPageSize];
+    for (unsigned int i = 0; i < GlyphPageSize; ++i)
+      page[i].known = false;
+  }
+
+  GlyphMetrics &metrics = page[c % GlyphPageSize];
+  if (!metrics.known) {
+    const FT_UInt glyph = XftCharIndex(_display.XDisplay(), font, c);
+    XGlyphInfo xgi;
+    XftGlyphExtents(_display.XDisplay(), font, &glyph, 1, &xgi);
+    metrics.x = xgi.x;
+    metrics.width = xgi.width;
+    metrics.xoff = xgi.xOff;
+    metrics.known = true;
+  }
+  return &metrics;
+}
+
+
+void bt::FontCache::releaseGlyphs(XftFont *font) {
+  GlyphTables::iterator it = glyph_tables.find(font);
+  if (it == glyph_tables.end())
+    return;
+
+  for (unsigned int i = 0; i < it->second.size(); ++i)
+    delete [] it->second[i];
+  glyph_tables.erase(it);
+}
+
+
+/*
+  Computes the ink extents of text the way XftTextExtents32() does, as
+  the union of the glyph boxes along the pen position.  Returns false
+  if text has characters outside the glyph table.
+*/
+static bool localExtents(XftFont *font, const bt::ustring &text,
+                         XGlyphInfo &xgi) {
+  int pen = 0, left = 0, right = 0;
+  for (bt::ustring::size_type i = 0; i < text.length(); ++i) {
+    const bt::FontCache::GlyphMetrics * const metrics =
+      bt::fontcache->findGlyph(font, text[i]);
+    if (!metrics)
+      return false;
+
+    const int l = pen - metrics->x;
+    const int r = l + metrics->width;
+    if (i == 0 || l < left)
+      left = l;
+    if (i == 0 || r > right)
+      right = r;
+    pen += metrics->xoff;
+  }
+
+  xgi.x = -left;
+  xgi.width = right - left;
+  return true;
+}
+#endif
+
+
 XFontSet bt::Font::fontSet(void) const {
   if (_fontset)
     return _fontset;
@@ -465,51 +655,97 @@ unsigned int bt::textIndent(unsigned int screen, const Font &font) {
 bt::Rect bt::textRect(unsigned int screen, const Font &font,
                       const bt::ustring &text) {
   const unsigned int indent = textIndent(screen, font);
+  Rect rect;
 
 #ifdef XFT
   XftFont * const f = font.xftFont(screen);
   if (f) {
     XGlyphInfo xgi;
+    if (localExtents(f, text, xgi)) {
+      return Rect(xgi.x, 0, xgi.width - xgi.x + (indent * 2),
+                  f->ascent + f->descent);
+    }
+
+    if (fontcache->findExtents(f, text, rect))
+      return rect;
+
     XftTextExtents32(fontcache->_display.XDisplay(), f,
                      reinterpret_cast<const FcChar32 *>(text.data()),
                      text.length(), &xgi);
-    return Rect(xgi.x, 0, xgi.width - xgi.x + (indent * 2),
+    rect = Rect(xgi.x, 0, xgi.width - xgi.x + (indent * 2),
                 f->ascent + f->descent);
+    fontcache->addExtents(f, text, rect);
+    return rect;
   }
 #endif
 
+  XFontSet const fs = font.fontSet();
+  if (fontcache->findExtents(fs, text, rect))
+    return rect;
+
   const std::string str = toLocale(text);
   XRectangle ink, unused;
-  XmbTextExtents(font.fontSet(), str.c_str(), str.length(), &ink, &unused);
-  return Rect(ink.x, 0, ink.width - ink.x + (indent * 2),
-              XExtentsOfFontSet(font.fontSet())->max_ink_extent.height);
+  XmbTextExtents(fs, str.c_str(), str.length(), &ink, &unused);
+  rect = Rect(ink.x, 0, ink.width - ink.x + (indent * 2),
+              XExtentsOfFontSet(fs)->max_ink_extent.height);
+  fontcache->addExtents(fs, text, rect);
+  return rect;
 }
 
 
-void bt::drawText(const Font &font, const Pen &pen,
-                  Drawable drawable, const Rect &rect,
-                  Alignment alignment, const bt::ustring &text) {
-  Rect tr = textRect(pen.screen(), font, text);
-  unsigned int indent = textIndent(pen.screen(), font);
+/*
+  Returns the rect of text aligned in rect, centered vertically.
+*/
+static bt::Rect alignText(unsigned int screen, const bt::Font &font,
+                          const bt::Rect &rect, bt::Alignment alignment,
+                          const bt::ustring &text) {
+  bt::Rect tr = bt::textRect(screen, font, text);
 
   // align vertically (center for now)
   tr.setY(rect.y() + ((rect.height() - tr.height()) / 2));
 
   // align horizontally
   switch (alignment) {
-  case AlignRight:
+  case bt::AlignRight:
     tr.setX(rect.x() + rect.width() - tr.width() - 1);
     break;
 
-  case AlignCenter:
+  case bt::AlignCenter:
     tr.setX(rect.x() + (rect.width() - tr.width()) / 2);
     break;
 
   default:
-  case AlignLeft:
+  case bt::AlignLeft:
     tr.setX(rect.x());
   }
 
+  return tr;
+}
+
+
+#ifdef XFT
+static void drawXftText(const bt::Pen &pen, Drawable drawable, XftFont *f,
+                        int x, int y, const bt::ustring &text) {
+  XftColor col;
+  col.color.red   = pen.color().red()   | pen.color().red()   << 8;
+  col.color.green = pen.color().green() | pen.color().green() << 8;
+  col.color.blue  = pen.color().blue()  | pen.color().blue()  << 8;
+  col.color.alpha = 0xffff;
+  col.pixel = pen.color().pixel(pen.screen());
+
+  XftDrawString32(pen.xftDraw(drawable), &col, f, x, y,
+                  reinterpret_cast<const FcChar32 *>(text.data()),
+                  text.length());
+}
+#endif
+
+
+void bt::drawText(const Font &font, const Pen &pen,
+                  Drawable drawable, const Rect &rect,
+                  Alignment alignment, const bt::ustring &text) {
+  Rect tr = alignText(pen.screen(), font, rect, alignment, text);
+  unsigned int indent = textIndent(pen.screen(), font);
+
 #if 0
   // draws the rect 'tr' in red... useful for debugging text placement
   Pen red(pen.screen(), Color(255, 0, 0));
@@ -520,17 +756,7 @@ void bt::drawText(const Font &font, const Pen &pen,
 #ifdef XFT
   XftFont * const f = font.xftFont(pen.screen());
   if (f) {
-    XftColor col;
-    col.color.red   = pen.color().red()   | pen.color().red()   << 8;
-    col.color.green = pen.color().green() | pen.color().green() << 8;
-    col.color.blue  = pen.color().blue()  | pen.color().blue()  << 8;
-    col.color.alpha = 0xffff;
-    col.pixel = pen.color().pixel(pen.screen());
-
-    XftDrawString32(pen.xftDraw(drawable), &col, f,
-                    tr.x() + indent, tr.y() + f->ascent,
-                    reinterpret_cast<const FcChar32 *>(text.data()),
-                    text.length());
+    drawXftText(pen, drawable, f, tr.x() + indent, tr.y() + f->ascent, text);
     return;
   }
 #endif
@@ -543,6 +769,90 @@ void bt::drawText(const Font &font, const Pen &pen,
 }
 
 
+bt::TextLayout::TextLayout(void)
+  : _screen(~0u), _alignment(AlignLeft), _x(0), _y(0)
+{ }
+
+
+bt::TextLayout::TextLayout(const TextLayout &other)
+  : _screen(other._screen), _font(other._font.fontName()),
+    _color(other._color), _rect(other._rect),
+    _alignment(other._alignment), _text(other._text),
+    _x(other._x), _y(other._y), _locale(other._locale)
+{ }
+
+
+bt::TextLayout &bt::TextLayout::operator=(const TextLayout &other) {
+  if (this == &other)
+    return *this;
+  _screen = other._screen;
+  _font = other._font;
+  _color = other._color;
+  _rect = other._rect;
+  _alignment = other._alignment;
+  _text = other._text;
+  _x = other._x;
+  _y = other._y;
+  _locale = other._locale;
+  return *this;
+}
+
+
+void bt::TextLayout::update(unsigned int screen, const Font &font,
+                            const Color &color, const Rect &rect,
+                            Alignment alignment, const ustring &text) {
+  if (_screen == screen && _font == font && _rect == rect
+      && _alignment == alignment && _text == text) {
+    // only the color can change without moving the text
+    if (_color != color)
+      _color = color;
+    return;
+  }
+
+  _screen = screen;
+  if (_font != font)
+    _font = font;
+  _color = color;
+  _rect = rect;
+  _alignment = alignment;
+  _text = text;
+
+  const Rect tr = alignText(_screen, _font, _rect, _alignment, _text);
+  _x = tr.x() + textIndent(_screen, _font);
+
+#ifdef XFT
+  XftFont * const f = _font.xftFont(_screen);
+  if (f) {
+    _y = tr.y() + f->ascent;
+    _locale.clear();
+    return;
+  }
+#endif
+
+  _y = tr.y() - XExtentsOfFontSet(_font.fontSet())->max_ink_extent.y;
+  _locale = toLocale(_text);
+}
+
+
+void bt::TextLayout::draw(Drawable drawable) const {
+  if (_screen == ~0u)
+    return; // never updated
+
+  const Pen pen(_screen, _color);
+
+#ifdef XFT
+  XftFont * const f = _font.xftFont(_screen);
+  if (f) {
+    drawXftText(pen, drawable, f, _x, _y, _text);
+    return;
+  }
+#endif
+
+  XmbDrawString(pen.XDisplay(), drawable, _font.fontSet(), pen.gc(),
+                _x, _y, _locale.c_str(), _locale.length());
+}
+
+
 bt::ustring bt::ellideText(const bt::ustring &text, size_t count,
                            const bt::ustring &ellide) {
   const bt::ustring::size_type len = text.length();
@@ -558,26 +868,111 @@ bt::ustring bt::ellideText(const bt::ustring &text, size_t count,
 }
 
 
+/*
+  Sets advances to the advance width of each character in text, and
+  returns false if the font cannot tell (fontsets only measure whole
+  strings).
+*/
+static bool glyphAdvances(unsigned int screen, const bt::Font &font,
+                          const bt::ustring &text,
+                          std::vector<int> &advances) {
+#ifdef XFT
+  XftFont * const f = font.xftFont(screen);
+  if (!f)
+    return false;
+
+  ::Display * const dpy = bt::fontcache->_display.XDisplay();
+  advances.resize(text.length());
+  for (bt::ustring::size_type i = 0; i < text.length(); ++i) {
+    const bt::FontCache::GlyphMetrics * const metrics =
+      bt::fontcache->findGlyph(f, text[i]);
+    if (metrics) {
+      advances[i] = metrics->xoff;
+      continue;
+    }
+
+    const FT_UInt glyph = XftCharIndex(dpy, f, text[i]);
+    XGlyphInfo xgi;
+    XftGlyphExtents(dpy, f, &glyph, 1, &xgi);
+    advances[i] = xgi.xOff;
+  }
+  return true;
+#else
+  (void) screen;
+  (void) font;
+  (void) text;
+  (void) advances;
+  return false;
+#endif
+}
+
+
 bt::ustring bt::ellideText(const bt::ustring &text,
                            unsigned int max_width,
                            const bt::ustring &ellide,
                            unsigned int screen,
                            const bt::Font &font) {
-  bt::ustring visible = text;
-  bt::Rect r = bt::textRect(screen, font, visible);
-
-  if (r.width() > max_width) {
-    const int min_c = (ellide.length() * 3) - 1;
-    int c = visible.length();
-    while (--c > min_c && r.width() > max_width) {
-      visible = bt::ellideText(text, c, ellide);
-      r = bt::textRect(screen, font, visible);
+  if (bt::textRect(screen, font, text).width() <= max_width)
+    return text;
+
+  /*
+    Find the largest count that fits with a binary search.
+    ellideText(text, c, ellide) keeps c/2 - e/2 characters from the
+    start of text and one less from the end, so with the advance of
+    each character the width of every candidate is a sum of two
+    prefix sums.  Without advances, each step measures the candidate.
+  */
+  const int len = text.length();
+  const int e = ellide.length();
+  const int min_c = (e * 3) - 1;
+
+  std::vector<int> advances, ellide_advances;
+  const bool local = (glyphAdvances(screen, font, text, advances)
+                      && glyphAdvances(screen, font, ellide,
+                                       ellide_advances));
+  std::vector<int> sums(len + 1, 0);
+  int ellide_width = 0;
+  if (local) {
+    for (int i = 0; i < len; ++i)
+      sums[i + 1] = sums[i] + advances[i];
+    for (int i = 0; i < e; ++i)
+      ellide_width += ellide_advances[i];
+  }
+  const int indent = textIndent(screen, font) * 2;
+
+  // ellideText() needs the ellide to be shorter than half the count
+  const int first = std::max(min_c + 1, (e * 2) + 2);
+  int best = first - 1, lo = first, hi = len - 1;
+  while (lo <= hi) {
+    const int c = (lo + hi) / 2;
+    unsigned int width;
+    if (local) {
+      const int head = (c / 2) - (e / 2);
+      const int tail = head - 1;
+      width = indent + sums[head] + ellide_width
+              + (sums[len] - sums[len - tail]);
+    } else {
+      width = bt::textRect(screen, font,
+                           bt::ellideText(text, c, ellide)).width();
     }
-    if (c <= min_c)
-      visible = ellide; // couldn't ellide enough
+
+    if (width <= max_width) {
+      best = c;
+      lo = c + 1;
+    } else {
+      hi = c - 1;
+    }
+  }
+
+  // advances ignore kerning and ink overhang, check the real extents
+  while (best >= first) {
+    const bt::ustring visible = bt::ellideText(text, best, ellide);
+    if (bt::textRect(screen, font, visible).width() <= max_width)
+      return visible;
+    --best;
   }
 
-  return visible;
+  return ellide; // couldn't ellide enough
 }
 
 
@@ -25,6 +25,8 @@
 #ifndef __Font_hh
 #define __Font_hh
 
+#include "Color.hh"
+#include "Rect.hh"
 #include "Unicode.hh"
 #include "Util.hh"
 
@@ -34,7 +36,6 @@ namespace bt {
   class Display;
   class Font;
   class Pen;
-  class Rect;
   class Resource;
 
   enum Alignment {
@@ -115,6 +116,36 @@ namespace bt {
     mutable unsigned int _screen; // only used for Xft
   };
 
+  /*
+    A string measured, aligned and converted for drawing with a font
+    and color in a rectangle.  Owners keep the layout across redraws,
+    since update() only does the work again when one of its arguments
+    has changed.  draw() then only sends the text.
+  */
+  class TextLayout {
+  public:
+    TextLayout(void);
+    TextLayout(const TextLayout &other);
+    TextLayout &operator=(const TextLayout &other);
+
+    void update(unsigned int screen, const Font &font, const Color &color,
+                const Rect &rect, Alignment alignment, const ustring &text);
+    void draw(Drawable drawable) const;
+
+  private:
+    unsigned int _screen;
+    Font _font;
+    Color _color;
+    Rect _rect;
+    Alignment _alignment;
+    ustring _text;
+
+    // baseline origin of the text
+    int _x, _y;
+    // the text in the locale's encoding, for fontsets
+    std::string _locale;
+  };
+
 } // namespace bt
 
 #endif // __Font_hh
@@ -26,12 +26,28 @@
 #include "Display.hh"
 #include "Pen.hh"
 #include "Texture.hh"
+#include "XDG.hh"
 
 #include <algorithm>
+#include <string>
 #include <vector>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef    XRENDER
+#  include <X11/extensions/Xrender.h>
+#endif // XRENDER
+#ifdef    XCB
+#  include <X11/Xlib-xcb.h>
+#  include <xcb/xproto.h>
+#endif // XCB
 #ifdef    MITSHM
 #  include <sys/types.h>
 #  include <sys/ipc.h>
@@ -40,15 +56,29 @@
 #  include <X11/extensions/XShm.h>
 #endif // MITSHM
 
+#ifdef    THREADS
+#  include <pthread.h>
+#  include <unistd.h>
+#endif // THREADS
+
+#ifdef    SIMD
+#  include <emmintrin.h>
+#  include <immintrin.h>
+#endif // SIMD
+
 #include <assert.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <cstring>
+#include <new>
 
 // #define COLORTABLE_DEBUG
+// #define GRADIENT_DEBUG
 // #define MITSHM_DEBUG
+// #define IMAGECACHE_DEBUG
+// #define ARENA_DEBUG
+// #define XRENDER_DEBUG
 
 
 static unsigned int right_align(unsigned int v)
@@ -70,6 +100,11 @@ static int lowest_bit(unsigned int v)
 
 unsigned int bt::Image::global_maximumColors = 0u; // automatic
 bt::DitherMode bt::Image::global_ditherMode = bt::OrderedDither;
+bt::RenderKernel bt::Image::global_renderKernel = bt::AutomaticKernel;
+unsigned int bt::Image::global_renderThreshold = 512u * 512u;
+unsigned int bt::Image::global_cacheThreshold = 0u;
+unsigned int bt::Image::global_cacheSize = 32u * 1024u;
+bool bt::Image::global_cacheWrites = true;
 
 
 namespace bt {
@@ -94,6 +129,47 @@ namespace bt {
                         unsigned int green,
                         unsigned int blue);
 
+    inline bool isTrueColor(void) const
+    { return visual_class == TrueColor; }
+    inline const Visual *visual(void) const
+    { return _dpy.screenInfo(_screen).visual(); }
+
+    /*
+      Ordered dither lookup tables.  Each channel maps an 8 bit value
+      to its contribution to the pixel (or to the index into the color
+      table), plus one more step if the dither error reaches the
+      threshold for that value.  The sum of the three channels is
+      passed to lookup() to get the pixel.
+    */
+    struct DitherChannel {
+      unsigned long value[256];
+      unsigned int threshold[256];
+      unsigned long step;
+
+      inline unsigned long operator()(unsigned int v,
+                                      unsigned int error) const
+      { return value[v] + (error >= threshold[v] ? step : 0ul); }
+    };
+    struct OrderedDitherTable {
+      DitherChannel red, green, blue;
+    };
+
+    inline const OrderedDitherTable &orderedDitherTable(void) const
+    { return dither_table; }
+
+    inline unsigned long lookup(unsigned long index) const {
+      switch (visual_class) {
+      case StaticGray:
+      case GrayScale:
+        return colors[index / 100];
+      case StaticColor:
+      case PseudoColor:
+        return colors[index];
+      default:
+        return index;
+      }
+    }
+
   private:
     const Display &_dpy;
     unsigned int _screen;
@@ -102,17 +178,215 @@ namespace bt {
     int red_shift, green_shift, blue_shift;
 
     std::vector<unsigned long> colors;
+    OrderedDitherTable dither_table;
+
+    void initOrderedDither(void);
+  };
+
+
+  /*
+    Scratch memory for rendering: image data, gradient tables, dither
+    error lines and XImage buffers.  Each thread has its own arena.
+
+    Memory comes from a single block with a bump pointer, and is given
+    back in LIFO order by RenderScope.  Allocations that do not fit in
+    the block are made separately.  The block grows to cover them when
+    the outermost scope ends.
+
+    The block is trimmed when it is more than twice the size of the
+    largest render in the last TrimInterval renders.  This way a
+    single large render (like bsetroot) does not pin its memory
+    forever.
+  */
+  class RenderArena {
+  public:
+    enum {
+      Alignment = 16,
+      MinimumSize = 64 * 1024,
+      TrimInterval = 16
+    };
+
+    struct Mark {
+      size_t used;
+      size_t overflow;
+    };
+
+    RenderArena(void)
+      : block(0), capacity(0), used(0), overflow_bytes(0),
+        peak(0), high_water(0), age(0), depth(0)
+    { }
+    ~RenderArena(void)
+    { clear(); }
+
+    void *allocate(size_t bytes);
+
+    Mark mark(void);
+    void release(const Mark &mark);
+
+    void clear(void);
+
+  private:
+    struct Overflow {
+      void *memory;
+      size_t size;
+    };
+
+    char *block;
+    size_t capacity, used;
+    std::vector<Overflow> overflow;
+    size_t overflow_bytes;
+    // largest usage in this render, and in the last TrimInterval renders
+    size_t peak, high_water;
+    unsigned int age, depth;
   };
 
 
-  typedef std::vector<unsigned char> Buffer;
-  static Buffer buffer;
+  void *RenderArena::allocate(size_t bytes) {
+    bytes = (bytes + Alignment - 1) & ~static_cast<size_t>(Alignment - 1);
+
+    void *memory;
+    if (used + bytes <= capacity) {
+      memory = block + used;
+      used += bytes;
+    } else {
+      memory = malloc(bytes);
+      if (!memory)
+        throw std::bad_alloc();
+      const Overflow o = { memory, bytes };
+      overflow.push_back(o);
+      overflow_bytes += bytes;
+    }
+
+    peak = std::max(peak, used + overflow_bytes);
+    return memory;
+  }
+
+
+  RenderArena::Mark RenderArena::mark(void) {
+    ++depth;
+    const Mark m = { used, overflow.size() };
+    return m;
+  }
+
+
+  void RenderArena::release(const Mark &m) {
+    while (overflow.size() > m.overflow) {
+      free(overflow.back().memory);
+      overflow_bytes -= overflow.back().size;
+      overflow.pop_back();
+    }
+    used = m.used;
+
+    assert(depth > 0);
+    if (--depth > 0)
+      return;
+
+    // the outermost scope has ended, size the block for the next render
+    if (peak >= high_water || ++age >= TrimInterval) {
+      high_water = peak;
+      age = 0;
+    }
+    peak = 0;
+
+    const size_t size =
+      std::max((high_water + MinimumSize - 1) & ~(MinimumSize - 1),
+               static_cast<size_t>(MinimumSize));
+    if (capacity < high_water || capacity > size * 2) {
+#ifdef ARENA_DEBUG
+      fprintf(stderr, "bt::RenderArena: resize %lu -> %lu bytes\n",
+              static_cast<unsigned long>(capacity),
+              static_cast<unsigned long>(size));
+#endif // ARENA_DEBUG
+      free(block);
+      block = static_cast<char *>(malloc(size));
+      capacity = block ? size : 0;
+    }
+  }
+
+
+  void RenderArena::clear(void) {
+    assert(depth == 0);
+    free(block);
+    block = 0;
+    capacity = used = 0;
+    peak = high_water = 0;
+    age = 0;
+  }
+
+
+#ifdef THREADS
+  static pthread_key_t arena_key;
+  static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+
+  static void deleteRenderArena(void *arena)
+  { delete static_cast<RenderArena *>(arena); }
+
+
+  static void createRenderArenaKey(void)
+  { pthread_key_create(&arena_key, deleteRenderArena); }
+#endif // THREADS
+
+
+  // returns the arena of the calling thread
+  static RenderArena &renderArena(void) {
+#ifdef THREADS
+    pthread_once(&arena_once, createRenderArenaKey);
+    RenderArena *arena =
+      static_cast<RenderArena *>(pthread_getspecific(arena_key));
+    if (!arena) {
+      arena = new RenderArena;
+      pthread_setspecific(arena_key, arena);
+    }
+    return *arena;
+#else
+    static RenderArena arena;
+    return arena;
+#endif // THREADS
+  }
+
+
+  /*
+    Memory allocated through a RenderScope is released when the scope
+    ends.
+  */
+  class RenderScope : public NoCopy {
+  public:
+    inline RenderScope(void)
+      : arena(renderArena()), m(arena.mark())
+    { }
+    inline ~RenderScope(void)
+    { arena.release(m); }
+
+    template <typename T>
+    inline T *allocate(size_t count)
+    { return static_cast<T *>(arena.allocate(count * sizeof(T))); }
+
+  private:
+    RenderArena &arena;
+    const RenderArena::Mark m;
+  };
 
 
   typedef std::vector<XColorTable*> XColorTableList;
   static XColorTableList colorTableList;
 
 
+  // returns the colortable for the screen, creating it if necessary
+  static XColorTable *colorTable(const Display &display,
+                                 unsigned int screen) {
+    if (colorTableList.empty())
+      colorTableList.resize(display.screenCount(), 0);
+
+    if (!colorTableList[screen]) {
+      colorTableList[screen] =
+        new XColorTable(display, screen, Image::maximumColors());
+    }
+
+    return colorTableList[screen];
+  }
+
+
   void destroyColorTables(void) {
     XColorTableList::iterator it = colorTableList.begin(),
                              end = colorTableList.end();
@@ -122,16 +396,12 @@ namespace bt {
       *it = 0;
     }
     colorTableList.clear();
-    buffer.clear();
+    renderArena().clear();
   }
 
 
 #ifdef MITSHM
-  static XShmSegmentInfo shm_info;
   static bool use_shm = false;
-  static bool shm_attached = false;
-  static int shm_id = -1;
-  static char *shm_addr = reinterpret_cast<char *>(-1);
 
 
   static int handleShmError(::Display *, XErrorEvent *) {
@@ -140,118 +410,1224 @@ namespace bt {
   }
 
 
-  void startupShm(const Display &display) {
-    // query MIT-SHM extension
-    if (!XShmQueryExtension(display.XDisplay()))
-      return;
-    use_shm = true;
-  }
-
+  /*
+    Shared memory segments are kept attached and reused for later
+    uploads.  Segment sizes are rounded up to a power of two, so that
+    images of similar size share segments.
 
-  void destroyShmImage(const Display &display, XImage *image) {
-    // tell the X server to detach
-    if (shm_attached) {
-      XShmDetach(display.XDisplay(), &shm_info);
+    Instead of waiting for the X server with XSync() after every
+    upload, each segment remembers the sequence number of the
+    XShmPutImage request that used it.  The segment can be reused once
+    Xlib has seen a reply, event or error for that request (or a later
+    one).  Only when no segment is available do we XSync(), which
+    completes all outstanding uploads at once.
+  */
+  class ShmPool {
+  public:
+    struct Segment {
+      XShmSegmentInfo info;
+      unsigned long size;
+      // sequence number of the last upload from this segment
+      unsigned long fence;
+      // true while an XImage uses the segment
+      bool busy;
+    };
+
+    enum {
+      // smallest segment
+      MinimumSize = 64ul * 1024ul,
+      // maximum total size of all segments
+      MaximumSize = 32ul * 1024ul * 1024ul
+    };
+
+    ShmPool(void) : total(0ul) { }
+
+    Segment *acquire(const Display &display, unsigned long usage);
+    void release(const Display &display, const XShmSegmentInfo *info);
+    void clear(const Display &display);
 
-      // wait for the server to render the image and detach the memory
-      // segment
-      XSync(display.XDisplay(), False);
+  private:
+    Segment *find(const Display &display, unsigned long size);
+    Segment *create(const Display &display, unsigned long size);
+    void destroy(Segment *segment);
+    bool evict(const Display &display);
+
+    typedef std::vector<Segment *> SegmentList;
+    SegmentList segments;
+    unsigned long total;
+  };
 
-      shm_attached = false;
-    }
 
-    // detach shared memory segment
-    if (shm_addr != reinterpret_cast<char *>(-1))
-      shmdt(shm_addr);
-    shm_addr = reinterpret_cast<char *>(-1);
+  static ShmPool shm_pool;
 
-    // destroy shared memory id
-    if (shm_id != -1)
-      shmctl(shm_id, IPC_RMID, 0);
-    shm_id = -1;
 
-    // destroy XImage
-    image->data = 0;
-    XDestroyImage(image);
+  // returns true if the X server has processed the segment's last upload
+  static bool isComplete(const Display &display,
+                         const ShmPool::Segment *segment) {
+    if (segment->busy)
+      return false;
+    const unsigned long last =
+      LastKnownRequestProcessed(display.XDisplay());
+    return static_cast<long>(last - segment->fence) >= 0;
   }
 
 
-  XImage *createShmImage(const Display &display, const ScreenInfo &screeninfo,
-                         unsigned int width, unsigned int height) {
-    if (!use_shm)
-      return 0;
+  ShmPool::Segment *ShmPool::find(const Display &display,
+                                  unsigned long size) {
+    SegmentList::iterator it = segments.begin(), end = segments.end();
+    for (; it != end; ++it) {
+      Segment *segment = *it;
+      if (segment->size != size || !isComplete(display, segment))
+        continue;
+      segment->busy = true;
+      return segment;
+    }
+    return 0;
+  }
 
-    // use MIT-SHM extension
-    XImage *image = XShmCreateImage(display.XDisplay(), screeninfo.visual(),
-                                    screeninfo.depth(), ZPixmap, 0,
-                                    &shm_info, width, height);
-    if (!image)
-      return 0;
+
+  ShmPool::Segment *ShmPool::create(const Display &display,
+                                    unsigned long size) {
+    Segment *segment = new Segment;
+    segment->size = size;
+    segment->fence = 0ul;
+    segment->busy = true;
 
     // get shared memory id
-    unsigned int usage = image->bytes_per_line * image->height;
-    shm_id = shmget(IPC_PRIVATE, usage, IPC_CREAT | 0644);
-    if (shm_id == -1) {
+    segment->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0644);
+    if (segment->info.shmid == -1) {
 #ifdef MITSHM_DEBUG
-      perror("bt::createShmImage: shmget");
+      perror("bt::ShmPool: shmget");
 #endif // MITSHM_DEBUG
 
       use_shm = false;
-      XDestroyImage(image);
+      delete segment;
       return 0;
     }
 
     // attached shared memory segment
-    shm_addr = static_cast<char *>(shmat(shm_id, 0, 0));
-    if (shm_addr == reinterpret_cast<char *>(-1)) {
+    segment->info.shmaddr =
+      static_cast<char *>(shmat(segment->info.shmid, 0, 0));
+    if (segment->info.shmaddr == reinterpret_cast<char *>(-1)) {
 #ifdef MITSHM_DEBUG
-      perror("bt::createShmImage: shmat");
+      perror("bt::ShmPool: shmat");
 #endif // MITSHM_DEBUG
 
       use_shm = false;
-      destroyShmImage(display, image);
+      shmctl(segment->info.shmid, IPC_RMID, 0);
+      delete segment;
       return 0;
     }
 
     // tell the X server to attach
-    shm_info.shmid = shm_id;
-    shm_info.shmaddr = shm_addr;
-    shm_info.readOnly = True;
+    segment->info.readOnly = True;
 
     static bool test_server_attach = true;
     if (test_server_attach) {
       // never checked if the X server can do shared memory...
       XErrorHandler old_handler = XSetErrorHandler(handleShmError);
-      XShmAttach(display.XDisplay(), &shm_info);
+      XShmAttach(display.XDisplay(), &segment->info);
       XSync(display.XDisplay(), False);
       XSetErrorHandler(old_handler);
 
       if (!use_shm) {
         // the X server failed to attach the shm segment
 
-#ifdef MITSHM_DEBUG
-        fprintf(stderr, "bt::createShmImage: X server failed to attach\n");
-#endif // MITSHM_DEBUG
+#ifdef MITSHM_DEBUG
+        fprintf(stderr, "bt::ShmPool: X server failed to attach\n");
+#endif // MITSHM_DEBUG
+
+        shmdt(segment->info.shmaddr);
+        shmctl(segment->info.shmid, IPC_RMID, 0);
+        delete segment;
+        return 0;
+      }
+
+      test_server_attach = false;
+    } else {
+      // we know the X server can attach to the memory segment
+      XShmAttach(display.XDisplay(), &segment->info);
+      XSync(display.XDisplay(), False);
+    }
+
+    /*
+      both sides are attached, so mark the segment for removal now.
+      it stays valid until the last detach, and the kernel frees it
+      when we exit, even on a crash or a restart (which execs without
+      running the destructors)
+    */
+    shmctl(segment->info.shmid, IPC_RMID, 0);
+
+    segments.push_back(segment);
+    total += size;
+
+#ifdef MITSHM_DEBUG
+    fprintf(stderr, "bt::ShmPool: new segment %lu bytes, %lu total\n",
+            size, total);
+#endif // MITSHM_DEBUG
+
+    return segment;
+  }
+
+
+  void ShmPool::destroy(Segment *segment) {
+    // the caller has made sure that the X server has detached.  the
+    // segment was marked for removal in create(), so this frees it
+    shmdt(segment->info.shmaddr);
+    total -= segment->size;
+    delete segment;
+  }
+
+
+  // detaches and destroys one idle segment, returns false if none are idle
+  bool ShmPool::evict(const Display &display) {
+    SegmentList::iterator it = segments.begin(), end = segments.end();
+    for (; it != end; ++it) {
+      Segment *segment = *it;
+      if (!isComplete(display, segment))
+        continue;
+
+      segments.erase(it);
+      XShmDetach(display.XDisplay(), &segment->info);
+      // wait for the server to detach the memory segment
+      XSync(display.XDisplay(), False);
+      destroy(segment);
+      return true;
+    }
+    return false;
+  }
+
+
+  ShmPool::Segment *ShmPool::acquire(const Display &display,
+                                     unsigned long usage) {
+    unsigned long size = MinimumSize;
+    while (size < usage)
+      size <<= 1;
+    if (size > MaximumSize)
+      return 0;
+
+    Segment *segment = find(display, size);
+    if (segment)
+      return segment;
+
+    while (total + size > MaximumSize) {
+      if (evict(display))
+        continue;
+
+      // everything is in flight, wait for the X server to catch up
+      XSync(display.XDisplay(), False);
+      segment = find(display, size);
+      if (segment)
+        return segment;
+      if (!evict(display))
+        return 0;
+    }
+
+    return create(display, size);
+  }
+
+
+  void ShmPool::release(const Display &display,
+                        const XShmSegmentInfo *info) {
+    SegmentList::iterator it = segments.begin(), end = segments.end();
+    for (; it != end; ++it) {
+      if (&(*it)->info != info)
+        continue;
+      // the upload is the last request sent
+      (*it)->fence = NextRequest(display.XDisplay()) - 1;
+      (*it)->busy = false;
+      return;
+    }
+    assert(false); // not reached
+  }
+
+
+  void ShmPool::clear(const Display &display) {
+    if (segments.empty())
+      return;
+
+    SegmentList::iterator it = segments.begin(), end = segments.end();
+    for (; it != end; ++it)
+      XShmDetach(display.XDisplay(), &(*it)->info);
+
+    // wait for the server to detach the memory segments
+    XSync(display.XDisplay(), False);
+
+    for (it = segments.begin(); it != end; ++it)
+      destroy(*it);
+    segments.clear();
+  }
+
+
+  void startupShm(const Display &display) {
+    // query MIT-SHM extension
+    if (!XShmQueryExtension(display.XDisplay()))
+      return;
+    use_shm = true;
+  }
+
+
+  void shutdownShm(const Display &display) {
+    shm_pool.clear(display);
+    use_shm = false;
+  }
+
+
+  void destroyShmImage(const Display &display, XImage *image) {
+    // the segment stays attached, and can be reused when the X server
+    // has finished with it
+    shm_pool.release(display,
+                     reinterpret_cast<XShmSegmentInfo *>(image->obdata));
+
+    // destroy XImage
+    image->data = 0;
+    XDestroyImage(image);
+  }
+
+
+  XImage *createShmImage(const Display &display, const ScreenInfo &screeninfo,
+                         unsigned int width, unsigned int height) {
+    if (!use_shm)
+      return 0;
+
+    // use MIT-SHM extension
+    XShmSegmentInfo shm_info;
+    XImage *image = XShmCreateImage(display.XDisplay(), screeninfo.visual(),
+                                    screeninfo.depth(), ZPixmap, 0,
+                                    &shm_info, width, height);
+    if (!image)
+      return 0;
+
+    const unsigned long usage = image->bytes_per_line * image->height;
+    ShmPool::Segment *segment = shm_pool.acquire(display, usage);
+    if (!segment) {
+      XDestroyImage(image);
+      return 0;
+    }
+
+    image->obdata = reinterpret_cast<char *>(&segment->info);
+    image->data = segment->info.shmaddr;
+    return image;
+  }
+#endif // MITSHM
+
+
+  /*
+    16.16 fixed point ramp, shared by all gradients to build their
+    tables.  The three channels start at the given (fixed point)
+    values and change by 'delta / steps' every time next() is called.
+  */
+  class Ramp {
+  public:
+    inline Ramp(int r, int g, int b,
+                int dr, int dg, int db, unsigned int steps)
+      : n(static_cast<int>(steps)) {
+      v[0] = r;
+      v[1] = g;
+      v[2] = b;
+      init(0, dr);
+      init(1, dg);
+      init(2, db);
+    }
+
+    static inline int fixed(int i)
+    { return i * 65536; }
+
+    // the integer part of channel c, truncated towards zero
+    inline int value(int c) const
+    { return (v[c] < 0) ? -((-v[c]) >> 16) : (v[c] >> 16); }
+    // the integer part of the absolute value of channel c
+    inline int absolute(int c) const
+    { return ((v[c] < 0) ? -v[c] : v[c]) >> 16; }
+    // the integer part of the square of channel c
+    inline unsigned int square(int c) const {
+      const unsigned int a = ((v[c] < 0) ? -v[c] : v[c]) >> 8;
+      return (a * a) >> 16;
+    }
+
+    inline void next(void) {
+      advance(0);
+      advance(1);
+      advance(2);
+    }
+
+  private:
+    /*
+      the step is split into a whole part and a remainder (in units of
+      1/steps), which is carried between steps so that rounding errors
+      do not accumulate across wide images
+    */
+    inline void init(int c, int delta) {
+      const int d = delta * 65536;
+      s[c] = d / n;
+      r[c] = d % n;
+      e[c] = 0;
+      inc[c] = (d < 0) ? -1 : 1;
+    }
+
+    inline void advance(int c) {
+      v[c] += s[c];
+      e[c] += r[c];
+      if (e[c] >= n || -e[c] >= n) {
+        v[c] += inc[c];
+        e[c] -= inc[c] * n;
+      }
+    }
+
+    int n, v[3], s[3], r[3], e[3], inc[3];
+  };
+
+
+  /*
+    Gradient kernels.
+
+    Every gradient is built from a table of values along the x axis
+    and a table of values along the y axis.  Building the tables is
+    cheap; combining them into width * height pixels is where the time
+    goes, so the combine step is done by one of the kernels below.
+
+    Tables are packed with one byte per channel (red in the low byte),
+    which is the same layout as RGB on the platforms where the SIMD
+    kernels are available.  All kernels do their arithmetic modulo 256
+    per channel, which is the truncation an int gets when it is stored
+    into the unsigned char channels of RGB, so the SIMD kernels produce
+    output that is bit-identical to the scalar kernels.
+  */
+  struct GradientKernels {
+    RenderKernel kernel;
+
+    // p[x] = value
+    void (*fill)(RGB *p, unsigned int value, unsigned int width);
+    // p[x] = xt[x] + yv
+    void (*add)(RGB *p, const unsigned int *xt, unsigned int yv,
+                unsigned int width);
+    // p[x] = to -/+ 2 * max(xt[x], yv)
+    void (*max)(RGB *p, const unsigned int *xt, unsigned int yv,
+                unsigned int to, unsigned int neg, unsigned int width);
+    // p[x] = to -/+ 2 * min(xt[x], yv)
+    void (*min)(RGB *p, const unsigned int *xt, unsigned int yv,
+                unsigned int to, unsigned int neg, unsigned int width);
+    // p[x] = to -/+ sqrt(xt[c][x] + yv[c]), xt and yv are per channel
+    void (*sqrt)(RGB *p, unsigned int * const *xt, const unsigned int *yv,
+                 unsigned int to, unsigned int neg, unsigned int width);
+    // p[x] = p[x] * 3 / 4
+    void (*interlace)(RGB *p, unsigned int width);
+    // p[x] = min(p[x] * 3 / 2, 255)
+    void (*lighten)(RGB *p, unsigned int width);
+  };
+
+
+  static inline unsigned int packRGB(unsigned int r,
+                                     unsigned int g,
+                                     unsigned int b) {
+    return (r & 0xff) | ((g & 0xff) << 8) | ((b & 0xff) << 16);
+  }
+
+
+  static inline void unpackRGB(RGB *p, unsigned int v) {
+    p->red      = v;
+    p->green    = v >> 8;
+    p->blue     = v >> 16;
+    p->reserved = 0;
+  }
+
+
+  // returns -v if neg is 0xff, v if neg is 0, modulo 256
+  static inline unsigned int applySign(unsigned int v, unsigned int neg)
+  { return (v ^ neg) - neg; }
+
+
+  static void scalar_fill(RGB *p, unsigned int value, unsigned int width) {
+    for (unsigned int x = 0; x < width; ++x, ++p)
+      unpackRGB(p, value);
+  }
+
+
+  static void scalar_add(RGB *p, const unsigned int *xt, unsigned int yv,
+                         unsigned int width) {
+    for (unsigned int x = 0; x < width; ++x, ++p) {
+      const unsigned int v = xt[x];
+      p->red      = v + yv;
+      p->green    = (v >> 8) + (yv >> 8);
+      p->blue     = (v >> 16) + (yv >> 16);
+      p->reserved = 0;
+    }
+  }
+
+
+  template <typename _Op>
+  static void scalar_cross(RGB *p, const unsigned int *xt, unsigned int yv,
+                           unsigned int to, unsigned int neg,
+                           unsigned int width) {
+    const _Op op = _Op();
+    for (unsigned int x = 0; x < width; ++x, ++p) {
+      const unsigned int v = xt[x];
+      p->red =
+        to - applySign(2 * op(v & 0xff, yv & 0xff), neg & 0xff);
+      p->green =
+        (to >> 8) - applySign(2 * op((v >> 8) & 0xff, (yv >> 8) & 0xff),
+                              (neg >> 8) & 0xff);
+      p->blue =
+        (to >> 16) - applySign(2 * op((v >> 16) & 0xff, (yv >> 16) & 0xff),
+                               (neg >> 16) & 0xff);
+      p->reserved = 0;
+    }
+  }
+
+
+  struct MaxOp {
+    inline unsigned int operator()(unsigned int a, unsigned int b) const
+    { return std::max(a, b); }
+  };
+
+
+  struct MinOp {
+    inline unsigned int operator()(unsigned int a, unsigned int b) const
+    { return std::min(a, b); }
+  };
+
+
+  /*
+    The elliptic gradient takes the square root of the sum of two
+    squares, each of which is at most 128^2.  The scalar kernel looks
+    the (truncated) square root up in this table instead of using the
+    FPU.
+  */
+  static const unsigned int sqrt_table_size = 2u * 128u * 128u;
+  static unsigned char sqrt_table[sqrt_table_size];
+
+
+  static void initSqrtTable(void) {
+    static bool done = false;
+    if (done)
+      return;
+    for (unsigned int n = 0, r = 0; n < sqrt_table_size; ++n) {
+      while ((r + 1) * (r + 1) <= n)
+        ++r;
+      sqrt_table[n] = r;
+    }
+    done = true;
+  }
+
+
+  static void scalar_sqrt(RGB *p, unsigned int * const *xt,
+                          const unsigned int *yv, unsigned int to,
+                          unsigned int neg, unsigned int width) {
+    for (unsigned int x = 0; x < width; ++x, ++p) {
+      assert(xt[0][x] + yv[0] < sqrt_table_size
+             && xt[1][x] + yv[1] < sqrt_table_size
+             && xt[2][x] + yv[2] < sqrt_table_size);
+      p->red =
+        to - applySign(sqrt_table[xt[0][x] + yv[0]], neg & 0xff);
+      p->green =
+        (to >> 8) - applySign(sqrt_table[xt[1][x] + yv[1]],
+                              (neg >> 8) & 0xff);
+      p->blue =
+        (to >> 16) - applySign(sqrt_table[xt[2][x] + yv[2]],
+                               (neg >> 16) & 0xff);
+      p->reserved = 0;
+    }
+  }
+
+
+  static void scalar_interlace(RGB *p, unsigned int width) {
+    for (unsigned int x = 0; x < width; ++x, ++p) {
+      p->red   = (p->red   >> 1) + (p->red   >> 2);
+      p->green = (p->green >> 1) + (p->green >> 2);
+      p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
+    }
+  }
+
+
+  static inline unsigned char lightenChannel(unsigned int c) {
+    c += c >> 1;
+    return (c > 255u) ? 255u : c;
+  }
+
+
+  static void scalar_lighten(RGB *p, unsigned int width) {
+    for (unsigned int x = 0; x < width; ++x, ++p) {
+      p->red   = lightenChannel(p->red);
+      p->green = lightenChannel(p->green);
+      p->blue  = lightenChannel(p->blue);
+    }
+  }
+
+
+  static const GradientKernels scalar_kernels = {
+    ScalarKernel,
+    scalar_fill,
+    scalar_add,
+    scalar_cross<MaxOp>,
+    scalar_cross<MinOp>,
+    scalar_sqrt,
+    scalar_interlace,
+    scalar_lighten
+  };
+
+
+#ifdef SIMD
+  /*
+    SSE2 kernels, 4 pixels per iteration.  The remainder of each row
+    is done with the scalar kernels.
+  */
+#define SSE2 __attribute__((target("sse2")))
+
+  SSE2 static inline __m128i sse2_sign(__m128i v, __m128i neg)
+  { return _mm_sub_epi8(_mm_xor_si128(v, neg), neg); }
+
+
+  SSE2 static void sse2_fill(RGB *p, unsigned int value, unsigned int width) {
+    const __m128i v = _mm_set1_epi32(value);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(p + x), v);
+    scalar_fill(p + x, value, width - x);
+  }
+
+
+  SSE2 static void sse2_add(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int width) {
+    const __m128i y = _mm_set1_epi32(yv);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(xt + x));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(p + x),
+                       _mm_add_epi8(v, y));
+    }
+    scalar_add(p + x, xt + x, yv, width - x);
+  }
+
+
+  SSE2 static void sse2_max(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int to, unsigned int neg,
+                            unsigned int width) {
+    const __m128i y = _mm_set1_epi32(yv);
+    const __m128i t = _mm_set1_epi32(to);
+    const __m128i n = _mm_set1_epi32(neg);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(xt + x));
+      __m128i m = _mm_max_epu8(v, y);
+      m = sse2_sign(_mm_add_epi8(m, m), n);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(p + x),
+                       _mm_sub_epi8(t, m));
+    }
+    scalar_cross<MaxOp>(p + x, xt + x, yv, to, neg, width - x);
+  }
+
+
+  SSE2 static void sse2_min(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int to, unsigned int neg,
+                            unsigned int width) {
+    const __m128i y = _mm_set1_epi32(yv);
+    const __m128i t = _mm_set1_epi32(to);
+    const __m128i n = _mm_set1_epi32(neg);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(xt + x));
+      __m128i m = _mm_min_epu8(v, y);
+      m = sse2_sign(_mm_add_epi8(m, m), n);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(p + x),
+                       _mm_sub_epi8(t, m));
+    }
+    scalar_cross<MinOp>(p + x, xt + x, yv, to, neg, width - x);
+  }
+
+
+  SSE2 static void sse2_sqrt(RGB *p, unsigned int * const *xt,
+                             const unsigned int *yv, unsigned int to,
+                             unsigned int neg, unsigned int width) {
+    /*
+      the sums are less than 2 * 128^2, which single precision
+      represents exactly, and truncating a single precision square
+      root of such a small integer gives the same result as the
+      integer square root table used by the scalar kernel.
+    */
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i y[3], t[3], n[3];
+    for (int c = 0; c < 3; ++c) {
+      y[c] = _mm_set1_epi32(yv[c]);
+      t[c] = _mm_set1_epi32((to >> (c * 8)) & 0xff);
+      n[c] = _mm_set1_epi32((neg >> (c * 8)) & 0xff);
+    }
+
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      __m128i out = _mm_setzero_si128();
+      for (int c = 0; c < 3; ++c) {
+        const __m128i v =
+          _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                        (xt[c] + x)), y[c]);
+        __m128i q = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(v)));
+        q = _mm_sub_epi32(_mm_xor_si128(q, n[c]), n[c]);
+        q = _mm_and_si128(_mm_sub_epi32(t[c], q), mask);
+        out = _mm_or_si128(out, _mm_slli_epi32(q, c * 8));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(p + x), out);
+    }
+
+    unsigned int * const rest[3] = { xt[0] + x, xt[1] + x, xt[2] + x };
+    scalar_sqrt(p + x, rest, yv, to, neg, width - x);
+  }
+
+
+  SSE2 static void sse2_interlace(RGB *p, unsigned int width) {
+    const __m128i m1 = _mm_set1_epi8(0x7f), m2 = _mm_set1_epi8(0x3f);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      __m128i * const q = reinterpret_cast<__m128i *>(p + x);
+      const __m128i v = _mm_loadu_si128(q);
+      _mm_storeu_si128(q,
+                       _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(v, 1), m1),
+                                    _mm_and_si128(_mm_srli_epi16(v, 2), m2)));
+    }
+    scalar_interlace(p + x, width - x);
+  }
+
+
+  SSE2 static void sse2_lighten(RGB *p, unsigned int width) {
+    const __m128i m1 = _mm_set1_epi8(0x7f);
+    unsigned int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      __m128i * const q = reinterpret_cast<__m128i *>(p + x);
+      const __m128i v = _mm_loadu_si128(q);
+      _mm_storeu_si128(q,
+                       _mm_adds_epu8(v, _mm_and_si128(_mm_srli_epi16(v, 1),
+                                                      m1)));
+    }
+    scalar_lighten(p + x, width - x);
+  }
+
+#undef SSE2
+
+
+  static const GradientKernels sse2_kernels = {
+    SSE2Kernel,
+    sse2_fill,
+    sse2_add,
+    sse2_max,
+    sse2_min,
+    sse2_sqrt,
+    sse2_interlace,
+    sse2_lighten
+  };
+
+
+  /*
+    AVX2 kernels, 8 pixels per iteration.  The remainder of each row
+    is done with the SSE2 kernels.
+  */
+#define AVX2 __attribute__((target("avx2")))
+
+  AVX2 static inline __m256i avx2_sign(__m256i v, __m256i neg)
+  { return _mm256_sub_epi8(_mm256_xor_si256(v, neg), neg); }
+
+
+  AVX2 static void avx2_fill(RGB *p, unsigned int value, unsigned int width) {
+    const __m256i v = _mm256_set1_epi32(value);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8)
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + x), v);
+    sse2_fill(p + x, value, width - x);
+  }
+
+
+  AVX2 static void avx2_add(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int width) {
+    const __m256i y = _mm256_set1_epi32(yv);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xt + x));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + x),
+                          _mm256_add_epi8(v, y));
+    }
+    sse2_add(p + x, xt + x, yv, width - x);
+  }
+
+
+  AVX2 static void avx2_max(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int to, unsigned int neg,
+                            unsigned int width) {
+    const __m256i y = _mm256_set1_epi32(yv);
+    const __m256i t = _mm256_set1_epi32(to);
+    const __m256i n = _mm256_set1_epi32(neg);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xt + x));
+      __m256i m = _mm256_max_epu8(v, y);
+      m = avx2_sign(_mm256_add_epi8(m, m), n);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + x),
+                          _mm256_sub_epi8(t, m));
+    }
+    sse2_max(p + x, xt + x, yv, to, neg, width - x);
+  }
+
+
+  AVX2 static void avx2_min(RGB *p, const unsigned int *xt, unsigned int yv,
+                            unsigned int to, unsigned int neg,
+                            unsigned int width) {
+    const __m256i y = _mm256_set1_epi32(yv);
+    const __m256i t = _mm256_set1_epi32(to);
+    const __m256i n = _mm256_set1_epi32(neg);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xt + x));
+      __m256i m = _mm256_min_epu8(v, y);
+      m = avx2_sign(_mm256_add_epi8(m, m), n);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + x),
+                          _mm256_sub_epi8(t, m));
+    }
+    sse2_min(p + x, xt + x, yv, to, neg, width - x);
+  }
+
+
+  AVX2 static void avx2_sqrt(RGB *p, unsigned int * const *xt,
+                             const unsigned int *yv, unsigned int to,
+                             unsigned int neg, unsigned int width) {
+    // see sse2_sqrt() for why single precision is sufficient
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i y[3], t[3], n[3];
+    for (int c = 0; c < 3; ++c) {
+      y[c] = _mm256_set1_epi32(yv[c]);
+      t[c] = _mm256_set1_epi32((to >> (c * 8)) & 0xff);
+      n[c] = _mm256_set1_epi32((neg >> (c * 8)) & 0xff);
+    }
+
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m256i out = _mm256_setzero_si256();
+      for (int c = 0; c < 3; ++c) {
+        const __m256i v =
+          _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                              (xt[c] + x)), y[c]);
+        __m256i q =
+          _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(v)));
+        q = _mm256_sub_epi32(_mm256_xor_si256(q, n[c]), n[c]);
+        q = _mm256_and_si256(_mm256_sub_epi32(t[c], q), mask);
+        out = _mm256_or_si256(out, _mm256_slli_epi32(q, c * 8));
+      }
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + x), out);
+    }
+
+    unsigned int * const rest[3] = { xt[0] + x, xt[1] + x, xt[2] + x };
+    sse2_sqrt(p + x, rest, yv, to, neg, width - x);
+  }
+
+
+  AVX2 static void avx2_interlace(RGB *p, unsigned int width) {
+    const __m256i m1 = _mm256_set1_epi8(0x7f), m2 = _mm256_set1_epi8(0x3f);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m256i * const q = reinterpret_cast<__m256i *>(p + x);
+      const __m256i v = _mm256_loadu_si256(q);
+      _mm256_storeu_si256(q,
+                          _mm256_add_epi8(_mm256_and_si256
+                                          (_mm256_srli_epi16(v, 1), m1),
+                                          _mm256_and_si256
+                                          (_mm256_srli_epi16(v, 2), m2)));
+    }
+    sse2_interlace(p + x, width - x);
+  }
+
+
+  AVX2 static void avx2_lighten(RGB *p, unsigned int width) {
+    const __m256i m1 = _mm256_set1_epi8(0x7f);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m256i * const q = reinterpret_cast<__m256i *>(p + x);
+      const __m256i v = _mm256_loadu_si256(q);
+      _mm256_storeu_si256(q,
+                          _mm256_adds_epu8(v, _mm256_and_si256
+                                           (_mm256_srli_epi16(v, 1), m1)));
+    }
+    sse2_lighten(p + x, width - x);
+  }
+
+#undef AVX2
+
+
+  static const GradientKernels avx2_kernels = {
+    AVX2Kernel,
+    avx2_fill,
+    avx2_add,
+    avx2_max,
+    avx2_min,
+    avx2_sqrt,
+    avx2_interlace,
+    avx2_lighten
+  };
+#endif // SIMD
+
+
+  static const GradientKernels *kernels = 0;
+
+
+  static const GradientKernels *selectKernels(RenderKernel requested) {
+    initSqrtTable();
+
+#ifdef SIMD
+    /*
+      the SIMD kernels store packed pixels directly, which only works
+      on little endian machines, where red is the low byte
+    */
+    RGB rgb;
+    rgb.red = 0x11;
+    rgb.green = 0x22;
+    rgb.blue = 0x33;
+    rgb.reserved = 0x44;
+    unsigned int packed;
+    memcpy(&packed, &rgb, sizeof(packed));
+    if (sizeof(RGB) != sizeof(unsigned int) || packed != 0x44332211u)
+      return &scalar_kernels;
+
+    __builtin_cpu_init();
+    const bool has_avx2 = __builtin_cpu_supports("avx2");
+    const bool has_sse2 = __builtin_cpu_supports("sse2");
+
+    switch (requested) {
+    case AutomaticKernel:
+    case AVX2Kernel:
+      if (has_avx2)
+        return &avx2_kernels;
+      // fall through
+    case SSE2Kernel:
+      if (has_sse2)
+        return &sse2_kernels;
+      // fall through
+    case ScalarKernel:
+      break;
+    }
+#else
+    (void) requested;
+#endif // SIMD
+    return &scalar_kernels;
+  }
+
+
+  /*
+    Band rendering.
+
+    The gradient and dither stages compute every row independently,
+    so large images are split into horizontal bands that are rendered
+    in parallel by a pool of worker threads.  The calling thread
+    renders bands too, and returns when all bands are done.
+  */
+  typedef void (*BandFunction)(void *arg, unsigned int y0, unsigned int y1);
+
+#ifdef THREADS
+  class WorkerPool {
+  public:
+    typedef void (*Function)(void *arg, unsigned int band);
+
+    explicit WorkerPool(unsigned int count);
+    ~WorkerPool(void);
+
+    // the number of threads, including the calling thread
+    inline unsigned int size(void) const
+    { return threads.size() + 1; }
+
+    void run(Function function, void *arg, unsigned int bands);
+
+  private:
+    static void *start(void *pool);
+    void work(void);
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake, done;
+    std::vector<pthread_t> threads;
+
+    Function function;
+    void *arg;
+    unsigned int bands, next, pending;
+    bool quit;
+  };
+
+
+  WorkerPool::WorkerPool(unsigned int count)
+    : function(0), arg(0), bands(0u), next(0u), pending(0u), quit(false)
+  {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&wake, 0);
+    pthread_cond_init(&done, 0);
+
+    for (unsigned int i = 1; i < count; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, 0, start, this) != 0)
+        break;
+      threads.push_back(thread);
+    }
+  }
+
+
+  WorkerPool::~WorkerPool(void) {
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&mutex);
+
+    std::vector<pthread_t>::iterator it = threads.begin(),
+                                    end = threads.end();
+    for (; it != end; ++it)
+      pthread_join(*it, 0);
+
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&mutex);
+  }
+
+
+  void *WorkerPool::start(void *pool) {
+    static_cast<WorkerPool *>(pool)->work();
+    return 0;
+  }
+
+
+  void WorkerPool::work(void) {
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+      while (!quit && next >= bands)
+        pthread_cond_wait(&wake, &mutex);
+      if (quit)
+        break;
+
+      const unsigned int band = next++;
+      pthread_mutex_unlock(&mutex);
+      function(arg, band);
+      pthread_mutex_lock(&mutex);
+
+      if (--pending == 0)
+        pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+
+  void WorkerPool::run(Function f, void *a, unsigned int n) {
+    pthread_mutex_lock(&mutex);
+    function = f;
+    arg = a;
+    bands = n;
+    next = 0u;
+    pending = n;
+    pthread_cond_broadcast(&wake);
+
+    // help out
+    while (next < bands) {
+      const unsigned int band = next++;
+      pthread_mutex_unlock(&mutex);
+      function(arg, band);
+      pthread_mutex_lock(&mutex);
+      --pending;
+    }
+
+    while (pending > 0)
+      pthread_cond_wait(&done, &mutex);
+    pthread_mutex_unlock(&mutex);
+  }
+
+
+  static WorkerPool *workers = 0;
+
+
+  void destroyWorkerPool(void) {
+    delete workers;
+    workers = 0;
+  }
+
+
+  struct Bands {
+    BandFunction function;
+    void *arg;
+    unsigned int height, rows;
+  };
+
+
+  static void runBand(void *arg, unsigned int band) {
+    const Bands * const bands = static_cast<const Bands *>(arg);
+    const unsigned int y0 = band * bands->rows;
+    bands->function(bands->arg, y0,
+                    std::min(y0 + bands->rows, bands->height));
+  }
+#endif // THREADS
+
+
+  /*
+    Calls function for rows [0, height), possibly split into bands of
+    a multiple of align rows each.
+  */
+  static void renderBands(BandFunction function, void *arg,
+                          unsigned int width, unsigned int height,
+                          unsigned int align) {
+#ifdef THREADS
+    const unsigned int threshold = Image::renderThreshold();
+    if (threshold > 0u && width * height >= threshold) {
+      if (!workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = new WorkerPool(std::max(1l, std::min(cpus, 16l)));
+      }
+
+      if (workers->size() > 1u) {
+        // a few bands per thread, to even out the load
+        unsigned int rows = height / (workers->size() * 4u);
+        rows = std::max(align, ((rows + align - 1u) / align) * align);
+
+        Bands bands = { function, arg, height, rows };
+        workers->run(runBand, &bands, (height + rows - 1u) / rows);
+        return;
+      }
+    }
+#else
+    (void) width;
+    (void) align;
+#endif // THREADS
+    function(arg, 0u, height);
+  }
+
+
+  /*
+    The combine step shared by all gradients, which fills a range of
+    rows from the x and y tables built by the gradient functions.
+  */
+  struct GradientRows {
+    enum Operation {
+      // copy row (y & 1), used by the horizontal gradient
+      Copy,
+      // fill each row with yt[y]
+      Fill,
+      // kernels->add(), kernels->max(), ...
+      Add,
+      Max,
+      Min,
+      Sqrt
+    };
+
+    Operation op;
+    RGB *data;
+    unsigned int width;
+    const unsigned int *xt, *yt;
+    // per channel tables, used by Sqrt
+    unsigned int *xtc[3];
+    const unsigned int *ytc[3];
+    unsigned int to, neg;
+  };
+
+
+  static void renderGradientRows(void *arg, unsigned int y0, unsigned int y1) {
+    const GradientRows &rows = *static_cast<const GradientRows *>(arg);
+    const unsigned int width = rows.width;
+    RGB *p = rows.data + (y0 * width);
+
+    for (unsigned int y = y0; y < y1; ++y, p += width) {
+      switch (rows.op) {
+      case GradientRows::Copy:
+        // the first two rows are already done
+        if (y > 1u)
+          memcpy(p, rows.data + ((y & 1u) * width), width * sizeof(RGB));
+        continue;
+      case GradientRows::Fill:
+        kernels->fill(p, rows.yt[y], width);
+        break;
+      case GradientRows::Add:
+        kernels->add(p, rows.xt, rows.yt[y], width);
+        break;
+      case GradientRows::Max:
+        kernels->max(p, rows.xt, rows.yt[y], rows.to, rows.neg, width);
+        break;
+      case GradientRows::Min:
+        kernels->min(p, rows.xt, rows.yt[y], rows.to, rows.neg, width);
+        break;
+      case GradientRows::Sqrt: {
+        const unsigned int yv[3] =
+          { rows.ytc[0][y], rows.ytc[1][y], rows.ytc[2][y] };
+        kernels->sqrt(p, rows.xtc, yv, rows.to, rows.neg, width);
+        break;
+      }
+      }
+    }
+  }
+
+
+  struct InterlaceRows {
+    RGB *data;
+    unsigned int width;
+  };
+
 
-        destroyShmImage(display, image);
-        return 0;
-      }
+  static void renderInterlaceRows(void *arg, unsigned int y0, unsigned int y1) {
+    const InterlaceRows &rows = *static_cast<const InterlaceRows *>(arg);
+    const unsigned int width = rows.width;
+    for (unsigned int y = y0 | 1u; y < y1; y += 2)
+      kernels->interlace(rows.data + (y * width), width);
+  }
 
-      test_server_attach = false;
-    } else {
-      // we know the X server can attach to the memory segment
-      XShmAttach(display.XDisplay(), &shm_info);
-    }
 
-    shm_attached = true;
-    image->data = shm_addr;
-    return image;
+  /*
+    The interlacing effect darkens every odd row.  It is a separate
+    pass over the finished gradient, so the gradient loops themselves
+    have no per-row branches.
+  */
+  static void interlace(RGB *data, unsigned int width, unsigned int height) {
+    InterlaceRows rows = { data, width };
+    renderBands(renderInterlaceRows, &rows, width, height, 2u);
   }
-#endif // MITSHM
+
+
+  // the interlacing effect on a packed table entry
+  static inline unsigned int interlacePacked(unsigned int v)
+  { return ((v >> 1) & 0x7f7f7fu) + ((v >> 2) & 0x3f3f3fu); }
 
 } // namespace bt
 
 
+/*
+  Allocates read-only cells for count colors.  The pixel of each color
+  is set to the allocated pixel, or to ~0ul if the allocation failed.
+  With XCB all requests are sent before the first reply is read, so a
+  whole color cube costs about one round trip instead of one per
+  color.
+*/
+static void allocColors(::Display *display, Colormap colormap,
+                        XColor *xcolors, unsigned int count) {
+#ifdef    XCB
+  xcb_connection_t * const c = XGetXCBConnection(display);
+  std::vector<xcb_alloc_color_cookie_t> cookies(count);
+  for (unsigned int i = 0; i < count; ++i) {
+    cookies[i] = xcb_alloc_color(c, colormap, xcolors[i].red,
+                                 xcolors[i].green, xcolors[i].blue);
+  }
+  for (unsigned int i = 0; i < count; ++i) {
+    // collect the error ourselves, a full colormap is expected here and
+    // must not reach Xlib's error handler as a BadAlloc
+    xcb_generic_error_t *error = 0;
+    xcb_alloc_color_reply_t * const reply =
+      xcb_alloc_color_reply(c, cookies[i], &error);
+    if (reply) {
+      xcolors[i].pixel = reply->pixel;
+      xcolors[i].red   = reply->red;
+      xcolors[i].green = reply->green;
+      xcolors[i].blue  = reply->blue;
+      free(reply);
+    } else {
+      free(error);
+      xcolors[i].pixel = ~0ul;
+    }
+  }
+#else
+  for (unsigned int i = 0; i < count; ++i) {
+    if (!XAllocColor(display, colormap, &xcolors[i]))
+      xcolors[i].pixel = ~0ul;
+  }
+#endif // XCB
+}
+
+
 bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
                              unsigned int maxColors)
   : _dpy(dpy), _screen(screen),
@@ -296,21 +1672,24 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
       const unsigned int g_max = n_green - 1;
       const unsigned int g_round = g_max / 2;
 
-      for (unsigned int g = 0; g < n_green; ++g) {
+      for (unsigned int g = 0; g < n_green; ++g)
         colors[g] = ~0ul;
 
-        if (visual_class & 1) {
+      if (visual_class & 1) {
+        std::vector<XColor> xcolors(n_green);
+        for (unsigned int g = 0; g < n_green; ++g) {
           const int gray = (g * 0xffff + g_round) / g_max;
+          xcolors[g].red   = gray;
+          xcolors[g].green = gray;
+          xcolors[g].blue  = gray;
+          xcolors[g].pixel = 0ul;
+        }
 
-          XColor xcolor;
-          xcolor.red   = gray;
-          xcolor.green = gray;
-          xcolor.blue  = gray;
-          xcolor.pixel = 0ul;
+        allocColors(_dpy.XDisplay(), colormap, &xcolors[0], n_green);
 
-          if (XAllocColor(_dpy.XDisplay(), colormap, &xcolor))
-            colors[g] = xcolor.pixel;
-          else
+        for (unsigned int g = 0; g < n_green; ++g) {
+          colors[g] = xcolors[g].pixel;
+          if (colors[g] == ~0ul)
             query_colormap = true;
         }
       }
@@ -368,26 +1747,30 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
       const int b_max = n_blue - 1;
       const int b_round = b_max / 2;
 
+      for (unsigned int x = 0; x < colors.size(); ++x)
+        colors[x] = ~0ul;
+
       // create color cube
-      for (unsigned int x = 0, r = 0; r < n_red; ++r) {
-        for (unsigned int g = 0; g < n_green; ++g) {
-          for (unsigned int b = 0; b < n_blue; ++b, ++x) {
-            colors[x] = ~0ul;
-
-            if (visual_class & 1) {
-              XColor xcolor;
-              xcolor.red   = (r * 0xffff + r_round) / r_max;
-              xcolor.green = (g * 0xffff + g_round) / g_max;
-              xcolor.blue  = (b * 0xffff + b_round) / b_max;
-              xcolor.pixel = 0ul;
-
-              if (XAllocColor(_dpy.XDisplay(), colormap, &xcolor))
-                colors[x] = xcolor.pixel;
-              else
-                query_colormap = true;
+      if (visual_class & 1) {
+        std::vector<XColor> xcolors(colors.size());
+        for (unsigned int x = 0, r = 0; r < n_red; ++r) {
+          for (unsigned int g = 0; g < n_green; ++g) {
+            for (unsigned int b = 0; b < n_blue; ++b, ++x) {
+              xcolors[x].red   = (r * 0xffff + r_round) / r_max;
+              xcolors[x].green = (g * 0xffff + g_round) / g_max;
+              xcolors[x].blue  = (b * 0xffff + b_round) / b_max;
+              xcolors[x].pixel = 0ul;
             }
           }
         }
+
+        allocColors(_dpy.XDisplay(), colormap, &xcolors[0], xcolors.size());
+
+        for (unsigned int x = 0; x < colors.size(); ++x) {
+          colors[x] = xcolors[x].pixel;
+          if (colors[x] == ~0ul)
+            query_colormap = true;
+        }
       }
       break;
     }
@@ -408,6 +1791,9 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
     break;
   } // switch
 
+  if (n_red < 256u || n_green < 256u || n_blue < 256u)
+    initOrderedDither();
+
 #ifdef COLORTABLE_DEBUG
   switch (visual_class) {
   case StaticGray:
@@ -465,6 +1851,8 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
 #endif // COLORTABLE_DEBUG
 
   // for missing colors, find the closest color in the existing colormap
+  std::vector<unsigned int> closest;
+  std::vector<XColor> xcolors;
   for (unsigned int x = 0; x < colors.size(); ++x) {
     if (colors[x] != ~0ul)
       continue;
@@ -513,19 +1901,26 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
 #endif // COLORTABLE_DEBUG
 
     if (visual_class & 1) {
-      XColor xcolor = queried[best];
-
-      if (XAllocColor(_dpy.XDisplay(), colormap, &xcolor)) {
-        colors[x] = xcolor.pixel;
-      } else {
-        colors[x] = gray < SHRT_MAX
-                    ? BlackPixel(_dpy.XDisplay(), _screen)
-                    : WhitePixel(_dpy.XDisplay(), _screen);
-      }
+      // allocated below, with black or white as the fallback
+      closest.push_back(x);
+      xcolors.push_back(queried[best]);
+      colors[x] = gray < SHRT_MAX
+                  ? BlackPixel(_dpy.XDisplay(), _screen)
+                  : WhitePixel(_dpy.XDisplay(), _screen);
     } else {
       colors[x] = best;
     }
   }
+
+  if (xcolors.empty())
+    return;
+
+  allocColors(_dpy.XDisplay(), colormap, &xcolors[0], xcolors.size());
+
+  for (unsigned int i = 0; i < closest.size(); ++i) {
+    if (xcolors[i].pixel != ~0ul)
+      colors[closest[i]] = xcolors[i].pixel;
+  }
 }
 
 
@@ -538,6 +1933,59 @@ bt::XColorTable::~XColorTable(void) {
 }
 
 
+/*
+  The ordered dither computes ((256 * max + max + 1) * value + error)
+  / 65536 for each channel, where max is the largest reduced value and
+  error comes from dither16 below.  Splitting the product into the
+  quotient and the remainder gives the reduced value for zero error,
+  and the smallest error that rounds it up by one.
+*/
+static void initDitherChannel(bt::XColorTable::DitherChannel &channel,
+                              unsigned int max, unsigned long unit) {
+  const unsigned long m = 256ul * max + max + 1ul;
+  for (unsigned int v = 0; v < 256; ++v) {
+    const unsigned long product = m * v;
+    channel.value[v] = (product >> 16) * unit;
+    channel.threshold[v] = 65536u - (product & 0xffff);
+  }
+  channel.step = unit;
+}
+
+
+void bt::XColorTable::initOrderedDither(void) {
+  unsigned int maxr = 255, maxg = 255, maxb = 255;
+  map(maxr, maxg, maxb);
+
+  // each channel contributes linearly to the result of pixel()
+  unsigned long r_unit, g_unit, b_unit;
+  switch (visual_class) {
+  case StaticGray:
+  case GrayScale:
+    r_unit = 30ul;
+    g_unit = 59ul;
+    b_unit = 11ul;
+    break;
+
+  case StaticColor:
+  case PseudoColor:
+    r_unit = n_green * n_blue;
+    g_unit = n_blue;
+    b_unit = 1ul;
+    break;
+
+  default:
+    r_unit = 1ul << red_shift;
+    g_unit = 1ul << green_shift;
+    b_unit = 1ul << blue_shift;
+    break;
+  }
+
+  initDitherChannel(dither_table.red,   maxr, r_unit);
+  initDitherChannel(dither_table.green, maxg, g_unit);
+  initDitherChannel(dither_table.blue,  maxb, b_unit);
+}
+
+
 void bt::XColorTable::map(unsigned int &red,
                           unsigned int &green,
                           unsigned int &blue) {
@@ -571,6 +2019,478 @@ unsigned long bt::XColorTable::pixel(unsigned int red,
 }
 
 
+#ifdef XRENDER
+namespace bt {
+
+  static bool use_xrender = false;
+
+
+  /*
+    Gradients need version 0.10 of the RENDER extension.
+  */
+  void startupXRender(const Display &display) {
+    int event_base, error_base, major, minor;
+    use_xrender = (XRenderQueryExtension(display.XDisplay(),
+                                         &event_base, &error_base)
+                   && XRenderQueryVersion(display.XDisplay(),
+                                          &major, &minor)
+                   && (major > 0 || minor >= 10));
+#ifdef XRENDER_DEBUG
+    fprintf(stderr, "bt::Image: %s server side gradients\n",
+            use_xrender ? "using" : "not using");
+#endif // XRENDER_DEBUG
+  }
+
+
+  static inline XRenderColor renderColor(const Color &color) {
+    XRenderColor c;
+    c.red   = color.red()   * 0x101;
+    c.green = color.green() * 0x101;
+    c.blue  = color.blue()  * 0x101;
+    c.alpha = 0xffff;
+    return c;
+  }
+
+
+  /*
+    Creates a gradient picture that matches the CPU gradients, which
+    compute the color at the top left corner of each pixel (the server
+    samples at pixel centers).  Returns None for unsupported textures.
+  */
+  static Picture createGradient(::Display *dpy, const Texture &texture,
+                                unsigned int width, unsigned int height) {
+    const unsigned long t = texture.texture();
+    const double w = width, h = height;
+    XFixed stops[2] = { XDoubleToFixed(0.0), XDoubleToFixed(1.0) };
+    XRenderColor colors[2] = { renderColor(texture.color1()),
+                               renderColor(texture.color2()) };
+
+    if (t & Texture::Elliptic) {
+      /*
+        the color goes from color2 in the center to color1 at a
+        distance of width horizontally and height vertically, which
+        is a circle stretched vertically by height / width
+      */
+      std::swap(colors[0], colors[1]);
+      XRadialGradient g;
+      g.inner.x = g.outer.x = XDoubleToFixed(w / 2.0 + 0.5);
+      g.inner.y = g.outer.y = XDoubleToFixed((h / 2.0 + 0.5) * w / h);
+      g.inner.radius = XDoubleToFixed(0.0);
+      g.outer.radius = XDoubleToFixed(w);
+      const Picture picture =
+        XRenderCreateRadialGradient(dpy, &g, stops, colors, 2);
+
+      XTransform transform = {{
+        { XDoubleToFixed(1.0), XDoubleToFixed(0.0),   XDoubleToFixed(0.0) },
+        { XDoubleToFixed(0.0), XDoubleToFixed(w / h), XDoubleToFixed(0.0) },
+        { XDoubleToFixed(0.0), XDoubleToFixed(0.0),   XDoubleToFixed(1.0) }
+      }};
+      XRenderSetPictureTransform(dpy, picture, &transform);
+      return picture;
+    }
+
+    /*
+      diagonal gradients are (x / width + y / height) / 2 along the
+      vector (c / width, c / height), with c chosen to make that so
+    */
+    const double c = 2.0 / (1.0 / (w * w) + 1.0 / (h * h));
+    double x1, y1, x2, y2;
+    if (t & Texture::Horizontal) {
+      x1 = 0.5;
+      y1 = 0.0;
+      x2 = w + 0.5;
+      y2 = 0.0;
+    } else if (t & Texture::Vertical) {
+      x1 = 0.0;
+      y1 = 0.5;
+      x2 = 0.0;
+      y2 = h + 0.5;
+    } else if (t & Texture::Diagonal) {
+      x1 = 0.5;
+      y1 = 0.5;
+      x2 = x1 + c / w;
+      y2 = y1 + c / h;
+    } else if (t & Texture::CrossDiagonal) {
+      x1 = w - 0.5;
+      y1 = 0.5;
+      x2 = x1 - c / w;
+      y2 = y1 + c / h;
+    } else {
+      // pyramid, rectangle and pipecross are rendered by the CPU
+      return None;
+    }
+
+    XLinearGradient g;
+    g.p1.x = XDoubleToFixed(x1);
+    g.p1.y = XDoubleToFixed(y1);
+    g.p2.x = XDoubleToFixed(x2);
+    g.p2.y = XDoubleToFixed(y2);
+    return XRenderCreateLinearGradient(dpy, &g, stops, colors, 2);
+  }
+
+
+  /*
+    The bevels make the edges 1.5 times brighter (by adding half of
+    the gradient again) or 0.75 times darker (by blending with black).
+  */
+  static void renderBevel(::Display *dpy, Picture gradient, Picture picture,
+                          bool raised, unsigned int bw,
+                          unsigned int width, unsigned int height) {
+    if (width <= 2 || height <= 2 || width <= bw * 4 || height <= bw * 4)
+      return;
+
+    const XRenderColor half = { 0, 0, 0, 0x8000 };
+    const XRenderColor dark = { 0, 0, 0, 0x4000 };
+    const Picture light = XRenderCreateSolidFill(dpy, &half);
+
+    const int x1 = bw, y1 = bw;
+    const int x2 = width - bw - 1, y2 = height - bw - 1;
+    const int w = width - bw * 2, h = height - bw * 2 - 2;
+
+    // top, left, right and bottom edges
+    const int edges[4][4] = {
+      { x1, y1,     w, 1 },
+      { x1, y1 + 1, 1, h },
+      { x2, y1 + 1, 1, h },
+      { x1, y2,     w, 1 }
+    };
+    for (unsigned int i = 0; i < 4; ++i) {
+      const int * const r = edges[i];
+      if ((i < 2) == raised) {
+        XRenderComposite(dpy, PictOpAdd, gradient, light, picture,
+                         r[0], r[1], 0, 0, r[0], r[1], r[2], r[3]);
+      } else {
+        XRenderFillRectangle(dpy, PictOpOver, picture, &dark,
+                             r[0], r[1], r[2], r[3]);
+      }
+    }
+
+    XRenderFreePicture(dpy, light);
+  }
+
+
+  /*
+    Renders the gradient on the X server.  This is only done for
+    visuals that do not need dithering, and for textures without the
+    interlace effect.  Returns None if the texture must be rendered
+    by the CPU.
+  */
+  static Pixmap renderOnServer(const Display &display, unsigned int screen,
+                               const Texture &texture,
+                               unsigned int width, unsigned int height) {
+    if (!use_xrender || (texture.texture() & Texture::Interlaced))
+      return None;
+
+    XColorTable * const colortable = colorTable(display, screen);
+    if (!colortable->isTrueColor()
+        || colortable->ditherMode() != NoDither)
+      return None;
+
+    ::Display * const dpy = display.XDisplay();
+    const ScreenInfo &screeninfo = display.screenInfo(screen);
+    XRenderPictFormat * const format =
+      XRenderFindVisualFormat(dpy, screeninfo.visual());
+    if (!format)
+      return None;
+
+    const Picture gradient = createGradient(dpy, texture, width, height);
+    if (gradient == None)
+      return None;
+
+    const Pixmap pixmap = XCreatePixmap(dpy, screeninfo.rootWindow(),
+                                        width, height, screeninfo.depth());
+    if (pixmap == None) {
+      XRenderFreePicture(dpy, gradient);
+      return None;
+    }
+
+    const Picture picture = XRenderCreatePicture(dpy, pixmap, format, 0, 0);
+    XRenderComposite(dpy, PictOpSrc, gradient, None, picture,
+                     0, 0, 0, 0, 0, 0, width, height);
+
+    if (texture.texture() & (Texture::Raised | Texture::Sunken)) {
+      renderBevel(dpy, gradient, picture,
+                  texture.texture() & Texture::Raised,
+                  texture.borderWidth(), width, height);
+    }
+
+    XRenderFreePicture(dpy, picture);
+    XRenderFreePicture(dpy, gradient);
+    return pixmap;
+  }
+
+} // namespace bt
+#endif // XRENDER
+
+
+namespace bt {
+
+  /*
+    Rendered gradients are kept on disk in $XDG_CACHE_HOME/blackbox,
+    so that they do not need to be rendered again after a restart or
+    reconfigure.  The file stores the RGB data after beveling but
+    before conversion to the pixel format of the visual, which means
+    one file serves every screen and visual.
+
+    The key is hashed to one of a fixed number of slots, which bounds
+    the number of files in the cache.  Each file contains the full key,
+    so a collision is simply a miss, and the slot is overwritten with
+    the newest image.  The total size is bounded by
+    Image::cacheSize(); after each write the oldest files are removed
+    until the cache fits.
+  */
+  class ImageFile {
+  public:
+    inline ImageFile(void)
+      : width(0u), height(0u), mapping(0), length(0)
+    { }
+    ~ImageFile(void)
+    { unmap(); }
+
+    // sets the image this file holds, must be called before map()
+    void setImage(const Texture &texture,
+                  unsigned int width, unsigned int height);
+
+    RGB *map(void);
+    void unmap(void);
+    inline bool isMapped(void) const
+    { return mapping != 0; }
+    void write(const RGB *data) const;
+
+  private:
+    struct Header {
+      char magic[8];
+      unsigned int width, height;
+      unsigned int key_length, data_offset;
+    };
+
+    std::string key, filename;
+    unsigned int width, height;
+    void *mapping;
+    size_t length;
+
+    static unsigned int dataOffset(size_t key_length)
+    { return (sizeof(Header) + key_length + 15u) & ~15u; }
+
+    static void trim(const std::string &directory, off_t budget);
+
+    struct OlderFile {
+      const std::vector<std::pair<time_t, std::string> > &files;
+      inline OlderFile(const std::vector<std::pair<time_t, std::string> > &f)
+        : files(f)
+      { }
+      inline bool operator()(unsigned int a, unsigned int b) const
+      { return files[a].first < files[b].first; }
+    };
+  };
+
+} // namespace bt
+
+
+static const char image_file_magic[8] = { 'b', 'b', 'R', 'G', 'B', '0', '2',
+                                          static_cast<char>(sizeof(bt::RGB)) };
+static const unsigned int image_file_slots = 1024u;
+
+
+void bt::ImageFile::setImage(const Texture &texture,
+                             unsigned int w, unsigned int h) {
+  width = w;
+  height = h;
+
+  char buf[128];
+  sprintf(buf, "|%lx|%02x%02x%02x|%02x%02x%02x|%02x%02x%02x|%u|%ux%u",
+          texture.texture(),
+          texture.color1().red(), texture.color1().green(),
+          texture.color1().blue(),
+          texture.color2().red(), texture.color2().green(),
+          texture.color2().blue(),
+          texture.borderColor().red(), texture.borderColor().green(),
+          texture.borderColor().blue(),
+          texture.borderWidth(), width, height);
+  key = texture.description() + buf;
+
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+    hash = (hash ^ static_cast<unsigned char>(*it)) * 16777619u;
+  sprintf(buf, "blackbox/images/%03x", hash % image_file_slots);
+  filename = buf;
+}
+
+
+/*
+  Maps the cached image read-only.  Returns zero if the image is not
+  in the cache.
+*/
+bt::RGB *bt::ImageFile::map(void) {
+  const std::string path = XDG::BaseDir::cacheHome() + filename;
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  const size_t expected =
+    dataOffset(key.size()) + width * height * sizeof(RGB);
+  struct stat st;
+  if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) != expected) {
+    close(fd);
+    return 0;
+  }
+
+  void *addr = mmap(0, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return 0;
+
+  const Header * const header = static_cast<const Header *>(addr);
+  const char * const bytes = static_cast<const char *>(addr);
+  if (memcmp(header->magic, image_file_magic, sizeof(header->magic)) != 0
+      || header->width != width
+      || header->height != height
+      || header->key_length != key.size()
+      || header->data_offset != dataOffset(key.size())
+      || key.compare(0, key.size(), bytes + sizeof(Header),
+                     key.size()) != 0) {
+    munmap(addr, expected);
+    return 0;
+  }
+
+#ifdef IMAGECACHE_DEBUG
+  fprintf(stderr, "bt::ImageFile: hit '%s' in %s\n",
+          key.c_str(), filename.c_str());
+#endif // IMAGECACHE_DEBUG
+
+  mapping = addr;
+  length = expected;
+  return reinterpret_cast<RGB *>(const_cast<char *>(bytes)
+                                 + header->data_offset);
+}
+
+
+void bt::ImageFile::unmap(void) {
+  if (!mapping)
+    return;
+  munmap(mapping, length);
+  mapping = 0;
+  length = 0;
+}
+
+
+/*
+  Writes the image to a temporary file and renames it over the slot,
+  so that readers never see a partially written file.  Failures are
+  silently ignored, the image is simply not cached.
+*/
+void bt::ImageFile::write(const RGB *data) const {
+  const off_t budget = static_cast<off_t>(Image::cacheSize()) * 1024;
+  if (static_cast<off_t>(dataOffset(key.size())
+                         + width * height * sizeof(RGB)) > budget)
+    return; // would never fit
+
+  const std::string path = XDG::BaseDir::writeCacheFile(filename);
+  if (path.empty())
+    return;
+
+  std::string tmp = path + ".XXXXXX";
+  std::vector<char> tmpname(tmp.begin(), tmp.end());
+  tmpname.push_back('\0');
+  const int fd = mkstemp(&tmpname[0]);
+  if (fd == -1)
+    return;
+
+  Header header;
+  memcpy(header.magic, image_file_magic, sizeof(header.magic));
+  header.width = width;
+  header.height = height;
+  header.key_length = key.size();
+  header.data_offset = dataOffset(key.size());
+
+  std::vector<char> prefix(header.data_offset, '\0');
+  memcpy(&prefix[0], &header, sizeof(Header));
+  memcpy(&prefix[sizeof(Header)], key.data(), key.size());
+
+  const struct iovec iov[2] = {
+    { &prefix[0], prefix.size() },
+    { const_cast<RGB *>(data), width * height * sizeof(RGB) }
+  };
+  const ssize_t total = iov[0].iov_len + iov[1].iov_len;
+  const bool ok = (writev(fd, iov, 2) == total);
+  if (close(fd) == -1 || !ok
+      || rename(&tmpname[0], path.c_str()) == -1) {
+    unlink(&tmpname[0]);
+    return;
+  }
+
+#ifdef IMAGECACHE_DEBUG
+  fprintf(stderr, "bt::ImageFile: wrote '%s' to %s\n",
+          key.c_str(), filename.c_str());
+#endif // IMAGECACHE_DEBUG
+
+  trim(path.substr(0, path.rfind('/')), budget);
+}
+
+
+/*
+  Removes the oldest files in the cache directory until the total
+  size is within budget.
+*/
+void bt::ImageFile::trim(const std::string &directory, off_t budget) {
+  DIR * const dir = opendir(directory.c_str());
+  if (!dir)
+    return;
+
+  std::vector<std::pair<time_t, std::string> > files;
+  std::vector<off_t> sizes;
+  off_t total = 0;
+  const struct dirent *entry;
+  while ((entry = readdir(dir)) != 0) {
+    if (entry->d_name[0] == '.')
+      continue;
+    const std::string path = directory + '/' + entry->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    files.push_back(std::make_pair(st.st_mtime, path));
+    sizes.push_back(st.st_size);
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  if (total <= budget)
+    return;
+
+  // oldest first
+  std::vector<unsigned int> order(files.size());
+  for (unsigned int i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), OlderFile(files));
+
+  for (unsigned int i = 0; i < order.size() && total > budget; ++i) {
+    const unsigned int x = order[i];
+    if (unlink(files[x].second.c_str()) == 0)
+      total -= sizes[x];
+
+#ifdef IMAGECACHE_DEBUG
+    fprintf(stderr, "bt::ImageFile: removed %s\n", files[x].second.c_str());
+#endif // IMAGECACHE_DEBUG
+  }
+}
+
+
+static void drawBorder(unsigned int screen, const bt::Texture &texture,
+                       Pixmap pixmap,
+                       unsigned int width, unsigned int height) {
+  if (!(texture.texture() & bt::Texture::Border))
+    return;
+
+  bt::Pen penborder(screen, texture.borderColor());
+  const unsigned int bw = texture.borderWidth();
+  for (unsigned int i = 0; i < bw; ++i) {
+    XDrawRectangle(penborder.XDisplay(), pixmap, penborder.gc(),
+                   i, i, width - (i * 2) - 1, height - (i * 2) - 1);
+  }
+}
+
+
 bt::Image::Image(unsigned int w, unsigned int h)
   : data(0), width(w), height(h)
 {
@@ -580,7 +2500,7 @@ bt::Image::Image(unsigned int w, unsigned int h)
 
 
 bt::Image::~Image(void) {
-  delete [] data;
+  // data belongs to the render arena or the cache file
   data = 0;
 }
 
@@ -594,11 +2514,112 @@ Pixmap bt::Image::render(const Display &display, unsigned int screen,
   if (!(texture.texture() & bt::Texture::Gradient))
     return None;
 
+#ifdef XRENDER
+  Pixmap pixmap = renderOnServer(display, screen, texture, width, height);
+  if (pixmap != None) {
+    drawBorder(screen, texture, pixmap, width, height);
+    return pixmap;
+  }
+#endif // XRENDER
+
+  RenderScope scope;
+  ImageFile file;
+  const bool cached = (global_cacheThreshold > 0
+                       && width * height >= global_cacheThreshold);
+  if (cached) {
+    file.setImage(texture, width, height);
+    data = file.map();
+  }
+
+  if (!data) {
+    data = scope.allocate<RGB>(width * height);
+
+    if (!kernels)
+      kernels = selectKernels(global_renderKernel);
+
+    renderGradient(texture);
+
+#ifdef GRADIENT_DEBUG
+    if (kernels != &scalar_kernels) {
+      // render again with the scalar kernels and compare the results
+      const GradientKernels * const save_kernels = kernels;
+      RGB * const save_data = data;
+
+      kernels = &scalar_kernels;
+      data = scope.allocate<RGB>(width * height);
+      renderGradient(texture);
+
+      unsigned int x, y, offset, mismatches = 0;
+      for (y = 0, offset = 0; y < height; ++y) {
+        for (x = 0; x < width; ++x, ++offset) {
+          if (data[offset].red      == save_data[offset].red
+              && data[offset].green == save_data[offset].green
+              && data[offset].blue  == save_data[offset].blue)
+            continue;
+          if (mismatches++ < 8) {
+            fprintf(stderr,
+                    "bt::Image: kernel %d mismatch at %4u,%4u: "
+                    "%02x/%02x/%02x != %02x/%02x/%02x\n",
+                    save_kernels->kernel, x, y,
+                    save_data[offset].red, save_data[offset].green,
+                    save_data[offset].blue,
+                    data[offset].red, data[offset].green, data[offset].blue);
+          }
+        }
+      }
+      if (mismatches > 0) {
+        fprintf(stderr, "bt::Image: '%s' %ux%u: %u pixels differ\n",
+                texture.description().c_str(), width, height, mismatches);
+      }
+
+      data = save_data;
+      kernels = save_kernels;
+    }
+#endif // GRADIENT_DEBUG
+
+    if (texture.texture() & bt::Texture::Raised)
+      raisedBevel(texture.borderWidth());
+    else if (texture.texture() & bt::Texture::Sunken)
+      sunkenBevel(texture.borderWidth());
+
+    if (cached && global_cacheWrites)
+      file.write(data);
+  }
+
+#ifdef XRENDER
+  pixmap = renderPixmap(display, screen);
+#else
+  Pixmap pixmap = renderPixmap(display, screen);
+#endif // XRENDER
+
+  // the data is released when the scope ends
+  file.unmap();
+  data = 0;
+
+  if (pixmap != None)
+    drawBorder(screen, texture, pixmap, width, height);
+
+  return pixmap;
+}
+
+
+bt::RenderKernel bt::Image::renderKernel(void) {
+  if (!kernels)
+    kernels = selectKernels(global_renderKernel);
+  return kernels->kernel;
+}
+
+
+void bt::Image::setRenderKernel(RenderKernel kernel) {
+  global_renderKernel = kernel;
+  kernels = selectKernels(global_renderKernel);
+}
+
+
+void bt::Image::renderGradient(const Texture &texture) {
   const Color from = texture.color1(), to = texture.color2();
   const bool interlaced = texture.texture() & bt::Texture::Interlaced;
 
-  data = new RGB[width * height];
-
   if (texture.texture() & bt::Texture::Diagonal)
     dgradient(from, to, interlaced);
   else if (texture.texture() & bt::Texture::Elliptic)
@@ -615,26 +2636,6 @@ Pixmap bt::Image::render(const Display &display, unsigned int screen,
     cdgradient(from, to, interlaced);
   else if (texture.texture() & bt::Texture::PipeCross)
     pcgradient(from, to, interlaced);
-
-  if (texture.texture() & bt::Texture::Raised)
-    raisedBevel(texture.borderWidth());
-  else if (texture.texture() & bt::Texture::Sunken)
-    sunkenBevel(texture.borderWidth());
-
-  Pixmap pixmap = renderPixmap(display, screen);
-
-  unsigned int bw = 0;
-  if (texture.texture() & bt::Texture::Border) {
-    Pen penborder(screen, texture.borderColor());
-    bw = texture.borderWidth();
-
-    for (unsigned int i = 0; i < bw; ++i) {
-      XDrawRectangle(penborder.XDisplay(), pixmap, penborder.gc(),
-                     i, i, width - (i * 2) - 1, height - (i * 2) - 1);
-    }
-  }
-
-  return pixmap;
 }
 
 
@@ -677,242 +2678,442 @@ static const unsigned int dither16[16][16] = {
 };
 
 
-/*
- * Helper function for TrueColorDither and renderXImage
- *
- * This handles the proper setting of the image data based on the image depth
- * and the machine's byte ordering
- */
-static void assignPixelData(unsigned int bit_depth, unsigned char **data,
-                            unsigned long pixel) {
-  unsigned char *pixel_data = *data;
-  switch (bit_depth) {
-  case  8: //  8bpp
-    pixel_data[0] = pixel;
-    ++pixel_data;
-    break;
+namespace bt {
+
+  /*
+    Pixel writers, one for each XImage format.  Formats are named by
+    their bits per pixel, plus one for MSBFirst byte order.  The format
+    is chosen once per image, so the inner loops below are
+    straight-line stores.  bytes is the size of one pixel.
+  */
+  template <unsigned int F>
+  struct PixelWriter;
+
+  template <>
+  struct PixelWriter<8> { //  8bpp
+    enum { bytes = 1 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel;
+      d += 1;
+    }
+  };
+
+  template <>
+  struct PixelWriter<16> { // 16bpp LSB
+    enum { bytes = 2 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel;
+      d[1] = pixel >> 8;
+      d += 2;
+    }
+  };
+
+  template <>
+  struct PixelWriter<17> { // 16bpp MSB
+    enum { bytes = 2 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel >> 8;
+      d[1] = pixel;
+      d += 2;
+    }
+  };
+
+  template <>
+  struct PixelWriter<24> { // 24bpp LSB
+    enum { bytes = 3 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel;
+      d[1] = pixel >> 8;
+      d[2] = pixel >> 16;
+      d += 3;
+    }
+  };
+
+  template <>
+  struct PixelWriter<25> { // 24bpp MSB
+    enum { bytes = 3 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel >> 16;
+      d[1] = pixel >> 8;
+      d[2] = pixel;
+      d += 3;
+    }
+  };
+
+  template <>
+  struct PixelWriter<32> { // 32bpp LSB
+    enum { bytes = 4 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel;
+      d[1] = pixel >> 8;
+      d[2] = pixel >> 16;
+      d[3] = pixel >> 24;
+      d += 4;
+    }
+  };
+
+  template <>
+  struct PixelWriter<33> { // 32bpp MSB
+    enum { bytes = 4 };
+    static inline void put(unsigned char *&d, unsigned long pixel) {
+      d[0] = pixel >> 24;
+      d[1] = pixel >> 16;
+      d[2] = pixel >> 8;
+      d[3] = pixel;
+      d += 4;
+    }
+  };
+
+
+  /*
+    Pixel sources.  pixel() takes color values that have already been
+    reduced by XColorTable::map(), rgb() takes 8 bit color values.
+
+    ColorTablePixels works for every visual.  TrueColorPixels does the
+    same thing with shifts only, for TrueColor visuals.
+  */
+  class ColorTablePixels {
+  public:
+    inline ColorTablePixels(XColorTable *colortable)
+      : table(colortable)
+    { }
+
+    inline unsigned long pixel(unsigned int r,
+                               unsigned int g,
+                               unsigned int b) const
+    { return table->pixel(r, g, b); }
+
+    inline unsigned long rgb(unsigned int r,
+                             unsigned int g,
+                             unsigned int b) const {
+      table->map(r, g, b);
+      return table->pixel(r, g, b);
+    }
+
+    inline unsigned long lookup(unsigned long index) const
+    { return table->lookup(index); }
+
+  private:
+    XColorTable *table;
+  };
+
+
+  class TrueColorPixels {
+  public:
+    inline TrueColorPixels(const Visual *visual) {
+      init(visual->red_mask,   red_shift,   red_down,   red_up);
+      init(visual->green_mask, green_shift, green_down, green_up);
+      init(visual->blue_mask,  blue_shift,  blue_down,  blue_up);
+    }
+
+    inline unsigned long pixel(unsigned int r,
+                               unsigned int g,
+                               unsigned int b) const {
+      return ((r << red_shift)
+              | (g << green_shift)
+              | (b << blue_shift));
+    }
+
+    inline unsigned long rgb(unsigned int r,
+                             unsigned int g,
+                             unsigned int b) const {
+      return (((r >> red_down) << red_up)
+              | ((g >> green_down) << green_up)
+              | ((b >> blue_down) << blue_up));
+    }
+
+    inline unsigned long lookup(unsigned long index) const
+    { return index; }
+
+  private:
+    /*
+      XColorTable::map() scales each channel by (1 << bits) / 256,
+      which is a shift right for channels narrower than 8 bits and a
+      shift left for wider channels
+    */
+    static void init(unsigned long mask, int &shift, int &down, int &up) {
+      const int bits = lowest_bit(right_align(mask) + 1);
+      shift = lowest_bit(mask);
+      down = std::max(8 - bits, 0);
+      up = shift + std::max(bits - 8, 0);
+    }
 
-  case 16: // 16bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data += 2;
-    break;
+    int red_shift, green_shift, blue_shift;
+    int red_down, green_down, blue_down;
+    int red_up, green_up, blue_up;
+  };
 
-  case 17: // 16bpp MSB
-    pixel_data[0] = pixel >> 8;
-    pixel_data[1] = pixel;
-    pixel_data += 2;
-    break;
 
-  case 24: // 24bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel >> 16;
-    pixel_data += 3;
-    break;
+  struct RenderTarget {
+    const RGB *data;
+    unsigned int width, height;
+    XColorTable *colortable;
+    unsigned int bytes_per_line;
+    unsigned char *pixel_data;
+  };
 
-  case 25: // 24bpp MSB
-    pixel_data[0] = pixel >> 16;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel;
-    pixel_data += 3;
-    break;
 
-  case 32: // 32bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel >> 16;
-    pixel_data[3] = pixel >> 24;
-    pixel_data += 4;
-    break;
+  template <class Writer, class Pixels>
+  struct NoDitherPath {
+    static const bool banded = true;
 
-  case 33: // 32bpp MSB
-    pixel_data[0] = pixel >> 24;
-    pixel_data[1] = pixel >> 16;
-    pixel_data[2] = pixel >> 8;
-    pixel_data[3] = pixel;
-    pixel_data += 4;
-    break;
-  }
-  *data = pixel_data; // assign back so we don't lose our place
-}
+    static void run(const RenderTarget &t, const Pixels &pixels) {
+      const RGB *p = t.data;
+      unsigned char *ppixel_data = t.pixel_data;
 
+      for (unsigned int y = 0; y < t.height; ++y) {
+        unsigned char *pixel_data = ppixel_data;
+        for (unsigned int x = 0; x < t.width; ++x, ++p)
+          Writer::put(pixel_data, pixels.rgb(p->red, p->green, p->blue));
+        ppixel_data += t.bytes_per_line;
+      }
+    }
+  };
 
-// algorithm: ordered dithering... many many thanks to rasterman
-// (raster@rasterman.com) for telling me about this... portions of this
-// code is based off of his code in Imlib
-void bt::Image::OrderedDither(XColorTable *colortable,
-                              unsigned int bit_depth,
-                              unsigned int bytes_per_line,
-                              unsigned char *pixel_data) {
-  unsigned int x, y, dithx, dithy, r, g, b, error, offset;
-  unsigned char *ppixel_data = pixel_data;
 
-  unsigned int maxr = 255, maxg = 255, maxb = 255;
-  colortable->map(maxr, maxg, maxb);
+  // algorithm: ordered dithering... many many thanks to rasterman
+  // (raster@rasterman.com) for telling me about this... portions of this
+  // code is based off of his code in Imlib
+  template <class Writer, class Pixels>
+  struct OrderedDitherPath {
+    // bands are a multiple of 16 rows, so the dither pattern lines up
+    static const bool banded = true;
+
+    static void run(const RenderTarget &t, const Pixels &pixels) {
+      const XColorTable::OrderedDitherTable &table =
+        t.colortable->orderedDitherTable();
+      const RGB *p = t.data;
+      unsigned char *ppixel_data = t.pixel_data;
+
+      for (unsigned int y = 0; y < t.height; ++y) {
+        const unsigned int * const dither = dither16[y & 15];
+        unsigned char *pixel_data = ppixel_data;
+
+        for (unsigned int x = 0; x < t.width; ++x, ++p) {
+          const unsigned int error = dither[x & 15];
+          Writer::put(pixel_data,
+                      pixels.lookup(table.red(p->red, error)
+                                    + table.green(p->green, error)
+                                    + table.blue(p->blue, error)));
+        }
+
+        ppixel_data += t.bytes_per_line;
+      }
+    }
+  };
 
-  for (y = 0, offset = 0; y < height; ++y) {
-    dithy = y & 15;
 
-    for (x = 0; x < width; ++x, ++offset) {
-      dithx = x & 15;
+  template <class Writer, class Pixels>
+  struct FloydSteinbergDitherPath {
+    // the error is carried from one row to the next
+    static const bool banded = false;
 
-      error = dither16[dithy][dithx];
+    static void run(const RenderTarget &t, const Pixels &pixels);
+  };
 
-      r = (((256 * maxr + maxr + 1) * data[offset].red   + error) / 65536);
-      g = (((256 * maxg + maxg + 1) * data[offset].green + error) / 65536);
-      b = (((256 * maxb + maxb + 1) * data[offset].blue  + error) / 65536);
 
-      assignPixelData(bit_depth, &pixel_data, colortable->pixel(r, g, b));
-    }
+  template <class Pixels>
+  struct PixelBands {
+    const RenderTarget *target;
+    const Pixels *pixels;
+  };
+
 
-    pixel_data = (ppixel_data += bytes_per_line);
+  template <class Path, class Pixels>
+  static void renderPixelBand(void *arg, unsigned int y0, unsigned int y1) {
+    const PixelBands<Pixels> &bands =
+      *static_cast<const PixelBands<Pixels> *>(arg);
+    RenderTarget t = *bands.target;
+    t.data += y0 * t.width;
+    t.height = y1 - y0;
+    t.pixel_data += y0 * t.bytes_per_line;
+    Path::run(t, *bands.pixels);
   }
-}
 
 
-void bt::Image::FloydSteinbergDither(XColorTable *colortable,
-                                     unsigned int bit_depth,
-                                     unsigned int bytes_per_line,
-                                     unsigned char *pixel_data) {
-  int * const error = new int[width * 6];
-  int * const r_line1 = error + (width * 0);
-  int * const g_line1 = error + (width * 1);
-  int * const b_line1 = error + (width * 2);
-  int * const r_line2 = error + (width * 3);
-  int * const g_line2 = error + (width * 4);
-  int * const b_line2 = error + (width * 5);
-
-  int rer, ger, ber;
-  unsigned int x, y, r, g, b, offset;
-  unsigned char *ppixel_data = pixel_data;
-  RGB *pixels = new RGB[width];
+  template <class Path, class Pixels>
+  static void renderPixelBands(const RenderTarget &t, const Pixels &pixels) {
+    if (!Path::banded) {
+      Path::run(t, pixels);
+      return;
+    }
 
-  unsigned int maxr = 255, maxg = 255, maxb = 255;
-  colortable->map(maxr, maxg, maxb);
-  maxr = 255u / maxr;
-  maxg = 255u / maxg;
-  maxb = 255u / maxb;
-
-  for (y = 0, offset = 0; y < height; ++y) {
-    const bool reverse = bool(y & 1);
-
-    int * const rl1 = (reverse) ? r_line2 : r_line1;
-    int * const gl1 = (reverse) ? g_line2 : g_line1;
-    int * const bl1 = (reverse) ? b_line2 : b_line1;
-    int * const rl2 = (reverse) ? r_line1 : r_line2;
-    int * const gl2 = (reverse) ? g_line1 : g_line2;
-    int * const bl2 = (reverse) ? b_line1 : b_line2;
-
-    if (y == 0) {
-      for (x = 0; x < width; ++x) {
-        rl1[x] = static_cast<int>(data[x].red);
-        gl1[x] = static_cast<int>(data[x].green);
-        bl1[x] = static_cast<int>(data[x].blue);
-      }
+    PixelBands<Pixels> bands = { &t, &pixels };
+    renderBands(renderPixelBand<Path, Pixels>, &bands,
+                t.width, t.height, 16u);
+  }
+
+
+  template <template <class, class> class Path, class Pixels>
+  static void renderPixels(const RenderTarget &t, unsigned int format,
+                           const Pixels &pixels) {
+    switch (format) {
+    case  8:
+      renderPixelBands<Path<PixelWriter< 8>, Pixels> >(t, pixels);
+      break;
+    case 16:
+      renderPixelBands<Path<PixelWriter<16>, Pixels> >(t, pixels);
+      break;
+    case 17:
+      renderPixelBands<Path<PixelWriter<17>, Pixels> >(t, pixels);
+      break;
+    case 24:
+      renderPixelBands<Path<PixelWriter<24>, Pixels> >(t, pixels);
+      break;
+    case 25:
+      renderPixelBands<Path<PixelWriter<25>, Pixels> >(t, pixels);
+      break;
+    case 32:
+      renderPixelBands<Path<PixelWriter<32>, Pixels> >(t, pixels);
+      break;
+    case 33:
+      renderPixelBands<Path<PixelWriter<33>, Pixels> >(t, pixels);
+      break;
     }
-    if (y+1 < height) {
-      for (x = 0; x < width; ++x) {
-        rl2[x] = static_cast<int>(data[offset + width + x].red);
-        gl2[x] = static_cast<int>(data[offset + width + x].green);
-        bl2[x] = static_cast<int>(data[offset + width + x].blue);
-      }
+  }
+
+
+  /*
+    Renders the image to pixel_data in the given format, with the
+    pixel writer and pixel source picked once for the whole image.
+  */
+  template <template <class, class> class Path>
+  static void renderPixels(const RenderTarget &t, unsigned int format) {
+    if (t.colortable->isTrueColor()) {
+      renderPixels<Path>(t, format, TrueColorPixels(t.colortable->visual()));
+    } else {
+      renderPixels<Path>(t, format, ColorTablePixels(t.colortable));
     }
+  }
 
-    // bi-directional dither
-    if (reverse) {
-      for (x = 0; x < width; ++x) {
-        r = static_cast<unsigned int>(std::max(std::min(rl1[x], 255), 0));
-        g = static_cast<unsigned int>(std::max(std::min(gl1[x], 255), 0));
-        b = static_cast<unsigned int>(std::max(std::min(bl1[x], 255), 0));
 
-        colortable->map(r, g, b);
+  static inline unsigned int clampColor(int v)
+  { return static_cast<unsigned int>(v < 0 ? 0 : (v > 255 ? 255 : v)); }
+
+
+  /*
+    The error lines have an unused entry at each end, so that errors
+    can be spread to both neighbors without checking for the edges.
+    Rows are dithered in alternating directions; the direction only
+    changes where the loop starts and the sign of dx.
+  */
+  template <class Writer, class Pixels>
+  void FloydSteinbergDitherPath<Writer, Pixels>::run(const RenderTarget &t,
+                                                     const Pixels &pixels) {
+    const RGB * const data = t.data;
+    const unsigned int width = t.width, height = t.height;
+    XColorTable * const colortable = t.colortable;
+
+    const unsigned int stride = width + 2;
+    RenderScope scope;
+    int * const error = scope.allocate<int>(stride * 6);
+    memset(error, 0, stride * 6 * sizeof(int));
+    int * const r_line1 = error + (stride * 0);
+    int * const g_line1 = error + (stride * 1);
+    int * const b_line1 = error + (stride * 2);
+    int * const r_line2 = error + (stride * 3);
+    int * const g_line2 = error + (stride * 4);
+    int * const b_line2 = error + (stride * 5);
+
+    unsigned int x, y, r, g, b, offset;
+    unsigned char *ppixel_data = t.pixel_data;
+
+    unsigned int maxr = 255, maxg = 255, maxb = 255;
+    colortable->map(maxr, maxg, maxb);
+    maxr = 255u / maxr;
+    maxg = 255u / maxg;
+    maxb = 255u / maxb;
 
-        pixels[x].red   = r;
-        pixels[x].green = g;
-        pixels[x].blue  = b;
-
-        rer = rl1[x] - static_cast<int>(r * maxr);
-        ger = gl1[x] - static_cast<int>(g * maxg);
-        ber = bl1[x] - static_cast<int>(b * maxb);
-
-        if (x+1 < width) {
-          rl1[x+1] += rer * 7 / 16;
-          gl1[x+1] += ger * 7 / 16;
-          bl1[x+1] += ber * 7 / 16;
-          rl2[x+1] += rer * 1 / 16;
-          gl2[x+1] += ger * 1 / 16;
-          bl2[x+1] += ber * 1 / 16;
+    for (y = 0, offset = 0; y < height; ++y) {
+      const bool reverse = bool(y & 1);
+
+      int * const rl1 = (reverse) ? r_line2 : r_line1;
+      int * const gl1 = (reverse) ? g_line2 : g_line1;
+      int * const bl1 = (reverse) ? b_line2 : b_line1;
+      int * const rl2 = (reverse) ? r_line1 : r_line2;
+      int * const gl2 = (reverse) ? g_line1 : g_line2;
+      int * const bl2 = (reverse) ? b_line1 : b_line2;
+
+      if (y == 0) {
+        for (x = 0; x < width; ++x) {
+          rl1[x + 1] = static_cast<int>(data[x].red);
+          gl1[x + 1] = static_cast<int>(data[x].green);
+          bl1[x + 1] = static_cast<int>(data[x].blue);
         }
-        rl2[x] += rer * 5 / 16;
-        gl2[x] += ger * 5 / 16;
-        bl2[x] += ber * 5 / 16;
-        if (x > 0) {
-          rl2[x-1] += rer * 3 / 16;
-          gl2[x-1] += ger * 3 / 16;
-          bl2[x-1] += ber * 3 / 16;
+      }
+      if (y+1 < height) {
+        for (x = 0; x < width; ++x) {
+          rl2[x + 1] = static_cast<int>(data[offset + width + x].red);
+          gl2[x + 1] = static_cast<int>(data[offset + width + x].green);
+          bl2[x + 1] = static_cast<int>(data[offset + width + x].blue);
         }
       }
-    } else {
-      for (x = width; x-- > 0; ) {
-        r = static_cast<unsigned int>(std::max(std::min(rl1[x], 255), 0));
-        g = static_cast<unsigned int>(std::max(std::min(gl1[x], 255), 0));
-        b = static_cast<unsigned int>(std::max(std::min(bl1[x], 255), 0));
+
+      // bi-directional dither
+      const int dx = reverse ? 1 : -1;
+      const int end = reverse ? int(width) + 1 : 0;
+      int i = reverse ? 1 : int(width);
+
+      for (; i != end; i += dx) {
+        r = clampColor(rl1[i]);
+        g = clampColor(gl1[i]);
+        b = clampColor(bl1[i]);
 
         colortable->map(r, g, b);
 
-        pixels[x].red   = r;
-        pixels[x].green = g;
-        pixels[x].blue  = b;
-
-        rer = rl1[x] - static_cast<int>(r * maxr);
-        ger = gl1[x] - static_cast<int>(g * maxg);
-        ber = bl1[x] - static_cast<int>(b * maxb);
-
-        if (x > 0) {
-          rl1[x-1] += rer * 7 / 16;
-          gl1[x-1] += ger * 7 / 16;
-          bl1[x-1] += ber * 7 / 16;
-          rl2[x-1] += rer * 1 / 16;
-          gl2[x-1] += ger * 1 / 16;
-          bl2[x-1] += ber * 1 / 16;
-        }
-        rl2[x] += rer * 5 / 16;
-        gl2[x] += ger * 5 / 16;
-        bl2[x] += ber * 5 / 16;
-        if (x+1 < width) {
-          rl2[x+1] += rer * 3 / 16;
-          gl2[x+1] += ger * 3 / 16;
-          bl2[x+1] += ber * 3 / 16;
-        }
+        unsigned char *pixel_data = ppixel_data + (i - 1) * Writer::bytes;
+        Writer::put(pixel_data, pixels.pixel(r, g, b));
+
+        const int rer = rl1[i] - static_cast<int>(r * maxr);
+        const int ger = gl1[i] - static_cast<int>(g * maxg);
+        const int ber = bl1[i] - static_cast<int>(b * maxb);
+
+        rl1[i + dx] += (rer * 7) >> 4;
+        gl1[i + dx] += (ger * 7) >> 4;
+        bl1[i + dx] += (ber * 7) >> 4;
+        rl2[i + dx] += rer >> 4;
+        gl2[i + dx] += ger >> 4;
+        bl2[i + dx] += ber >> 4;
+        rl2[i] += (rer * 5) >> 4;
+        gl2[i] += (ger * 5) >> 4;
+        bl2[i] += (ber * 5) >> 4;
+        rl2[i - dx] += (rer * 3) >> 4;
+        gl2[i - dx] += (ger * 3) >> 4;
+        bl2[i - dx] += (ber * 3) >> 4;
       }
-    }
-    for (x = 0; x < width; ++x) {
-      r = pixels[x].red;
-      g = pixels[x].green;
-      b = pixels[x].blue;
-      assignPixelData(bit_depth, &pixel_data, colortable->pixel(r, g, b));
-    }
 
-    offset += width;
-    pixel_data = (ppixel_data += bytes_per_line);
+      offset += width;
+      ppixel_data += t.bytes_per_line;
+    }
   }
 
-  delete [] error;
-  delete [] pixels;
+} // namespace bt
+
+
+void bt::Image::OrderedDither(XColorTable *colortable,
+                              unsigned int bit_depth,
+                              unsigned int bytes_per_line,
+                              unsigned char *pixel_data) {
+  const RenderTarget t = { data, width, height,
+                           colortable, bytes_per_line, pixel_data };
+  renderPixels<OrderedDitherPath>(t, bit_depth);
 }
 
 
-Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
-  // get the colortable for the screen. if necessary, we will create one.
-  if (colorTableList.empty())
-    colorTableList.resize(display.screenCount(), 0);
+void bt::Image::FloydSteinbergDither(XColorTable *colortable,
+                                     unsigned int bit_depth,
+                                     unsigned int bytes_per_line,
+                                     unsigned char *pixel_data) {
+  const RenderTarget t = { data, width, height,
+                           colortable, bytes_per_line, pixel_data };
+  renderPixels<FloydSteinbergDitherPath>(t, bit_depth);
+}
 
-  if (!colorTableList[screen])
-    colorTableList[screen] = new XColorTable(display, screen, maximumColors());
 
-  XColorTable *colortable = colorTableList[screen];
+Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
+  XColorTable *colortable = colorTable(display, screen);
   const ScreenInfo &screeninfo = display.screenInfo(screen);
+  RenderScope scope;
   XImage *image = 0;
   bool shm_ok = false;
 
@@ -932,8 +3133,8 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
     if (!image)
       return None;
 
-    buffer.reserve(image->bytes_per_line * (height + 1));
-    image->data = reinterpret_cast<char *>(&buffer[0]);
+    image->data =
+      scope.allocate<char>(image->bytes_per_line * (height + 1));
   }
 
   unsigned char *d = reinterpret_cast<unsigned char *>(image->data);
@@ -954,21 +3155,11 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
     break;
 
   case bt::NoDither: {
-    unsigned int x, y, offset, r, g, b;
-    unsigned char *pixel_data = d, *ppixel_data = d;
-
-    for (y = 0, offset = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++offset) {
-        r = data[offset].red;
-        g = data[offset].green;
-        b = data[offset].blue;
-
-        colortable->map(r, g, b);
-        assignPixelData(o, &pixel_data, colortable->pixel(r, g, b));
-      }
-
-      pixel_data = (ppixel_data += image->bytes_per_line);
-    }
+    const RenderTarget t = { data, width, height,
+                             colortable,
+                             static_cast<unsigned int>(image->bytes_per_line),
+                             d };
+    renderPixels<NoDitherPath>(t, o);
     break;
   }
   } // switch dmode
@@ -976,6 +3167,13 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
   Pixmap pixmap = XCreatePixmap(display.XDisplay(), screeninfo.rootWindow(),
                                 width, height, screeninfo.depth());
   if (pixmap == None) {
+#ifdef MITSHM
+    if (shm_ok) {
+      destroyShmImage(display, image);
+      return None;
+    }
+#endif // MITSHM
+
     image->data = 0;
     XDestroyImage(image);
 
@@ -1006,191 +3204,65 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
 }
 
 
-void bt::Image::raisedBevel(unsigned int border_width) {
-  if (width <= 2 || height <= 2 ||
-      width <= (border_width * 4) || height <= (border_width * 4))
-    return;
+namespace bt {
+
+  static inline void lightenPixel(RGB *p) {
+    p->red   = lightenChannel(p->red);
+    p->green = lightenChannel(p->green);
+    p->blue  = lightenChannel(p->blue);
+  }
+
+
+  static inline void darkenPixel(RGB *p) {
+    p->red   = (p->red   >> 1) + (p->red   >> 2);
+    p->green = (p->green >> 1) + (p->green >> 2);
+    p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
+  }
+
+
+  /*
+    A raised bevel lightens the top and left edges and darkens the
+    bottom and right edges, a sunken bevel does the opposite.  The top
+    and bottom edges are whole rows, done by the kernels.  The left
+    and right edges are one pixel per row.
+  */
+  static void renderBevel(RGB *data, unsigned int width, unsigned int height,
+                          unsigned int border_width, bool raised) {
+    if (width <= 2 || height <= 2 ||
+        width <= (border_width * 4) || height <= (border_width * 4))
+      return;
+
+    RGB * const p = data + (border_width * width) + border_width;
+    const unsigned int w = width - (border_width * 2);
+    const unsigned int h = height - (border_width * 2);
+    void (* const light)(RGB *, unsigned int) = kernels->lighten;
+    void (* const dark)(RGB *, unsigned int) = kernels->interlace;
+
+    // top of the bevel
+    (raised ? light : dark)(p, w);
+
+    // left and right of the bevel
+    RGB *lp = p + width + (raised ? 0 : w - 1);
+    RGB *dp = p + width + (raised ? w - 1 : 0);
+    for (unsigned int y = 2; y < h; ++y, lp += width, dp += width) {
+      lightenPixel(lp);
+      darkenPixel(dp);
+    }
+
+    // bottom of the bevel
+    (raised ? dark : light)(p + ((h - 1) * width), w);
+  }
 
-  RGB *p = data + (border_width * width) + border_width;
-  unsigned int w = width - (border_width * 2);
-  unsigned int h = height - (border_width * 2) - 2;
-  unsigned char rr, gg, bb;
-
-  // top of the bevel
-  do {
-    rr = p->red   + (p->red   >> 1);
-    gg = p->green + (p->green >> 1);
-    bb = p->blue  + (p->blue  >> 1);
-
-    if (rr < p->red  )
-      rr = ~0;
-    if (gg < p->green)
-      gg = ~0;
-    if (bb < p->blue )
-      bb = ~0;
-
-    p->red = rr;
-    p->green = gg;
-    p->blue = bb;
-
-    ++p;
-  } while (--w);
-
-  p += border_width + border_width;
-  w = width - (border_width * 2);
-
-  // left and right of the bevel
-  do {
-    rr = p->red   + (p->red   >> 1);
-    gg = p->green + (p->green >> 1);
-    bb = p->blue  + (p->blue  >> 1);
-
-    if (rr < p->red)
-      rr = ~0;
-    if (gg < p->green)
-      gg = ~0;
-    if (bb < p->blue)
-      bb = ~0;
-
-    p->red = rr;
-    p->green = gg;
-    p->blue = bb;
-
-    p += w - 1;
-
-    rr = (p->red   >> 2) + (p->red   >> 1);
-    gg = (p->green >> 2) + (p->green >> 1);
-    bb = (p->blue  >> 2) + (p->blue  >> 1);
-
-    if (rr > p->red  )
-      rr = 0;
-    if (gg > p->green)
-      gg = 0;
-    if (bb > p->blue )
-      bb = 0;
-
-    p->red   = rr;
-    p->green = gg;
-    p->blue  = bb;
-
-    p += border_width + border_width + 1;
-  } while (--h);
-
-  w = width - (border_width * 2);
-
-  // bottom of the bevel
-  do {
-    rr = (p->red   >> 2) + (p->red   >> 1);
-    gg = (p->green >> 2) + (p->green >> 1);
-    bb = (p->blue  >> 2) + (p->blue  >> 1);
-
-    if (rr > p->red  )
-      rr = 0;
-    if (gg > p->green)
-      gg = 0;
-    if (bb > p->blue )
-      bb = 0;
-
-    p->red   = rr;
-    p->green = gg;
-    p->blue  = bb;
-
-    ++p;
-  } while (--w);
+} // namespace bt
+
+
+void bt::Image::raisedBevel(unsigned int border_width) {
+  renderBevel(data, width, height, border_width, true);
 }
 
 
 void bt::Image::sunkenBevel(unsigned int border_width) {
-  if (width <= 2 || height <= 2 ||
-      width <= (border_width * 4) || height <= (border_width * 4))
-    return;
-
-  RGB *p = data + (border_width * width) + border_width;
-  unsigned int w = width - (border_width * 2);
-  unsigned int h = height - (border_width * 2) - 2;
-  unsigned char rr, gg, bb;
-
-  // top of the bevel
-  do {
-    rr = (p->red   >> 2) + (p->red   >> 1);
-    gg = (p->green >> 2) + (p->green >> 1);
-    bb = (p->blue  >> 2) + (p->blue  >> 1);
-
-    if (rr > p->red  )
-      rr = 0;
-    if (gg > p->green)
-      gg = 0;
-    if (bb > p->blue )
-      bb = 0;
-
-    p->red = rr;
-    p->green = gg;
-    p->blue = bb;
-
-    ++p;
-  } while (--w);
-
-  p += border_width + border_width;
-  w = width - (border_width * 2);
-
-  // left and right of the bevel
-  do {
-    rr = (p->red   >> 2) + (p->red   >> 1);
-    gg = (p->green >> 2) + (p->green >> 1);
-    bb = (p->blue  >> 2) + (p->blue  >> 1);
-
-    if (rr > p->red  )
-      rr = 0;
-    if (gg > p->green)
-      gg = 0;
-    if (bb > p->blue )
-      bb = 0;
-
-    p->red = rr;
-    p->green = gg;
-    p->blue = bb;
-
-    p += w - 1;
-
-    rr = p->red   + (p->red   >> 1);
-    gg = p->green + (p->green >> 1);
-    bb = p->blue  + (p->blue  >> 1);
-
-    if (rr < p->red)
-      rr = ~0;
-    if (gg < p->green)
-      gg = ~0;
-    if (bb < p->blue)
-      bb = ~0;
-
-    p->red   = rr;
-    p->green = gg;
-    p->blue  = bb;
-
-    p += border_width + border_width + 1;
-  } while (--h);
-
-  w = width - (border_width * 2);
-
-  // bottom of the bevel
-  do {
-    rr = p->red   + (p->red   >> 1);
-    gg = p->green + (p->green >> 1);
-    bb = p->blue  + (p->blue  >> 1);
-
-    if (rr < p->red)
-      rr = ~0;
-    if (gg < p->green)
-      gg = ~0;
-    if (bb < p->blue)
-      bb = ~0;
-
-    p->red   = rr;
-    p->green = gg;
-    p->blue  = bb;
-
-    ++p;
-  } while (--w);
+  renderBevel(data, width, height, border_width, false);
 }
 
 
@@ -1199,219 +3271,108 @@ void bt::Image::dgradient(const Color &from, const Color &to,
   // diagonal gradient code was written by Mike Cole <mike@mydot.com>
   // modified for interlacing by Brad Hughes
 
-  double drx, dgx, dbx, dry, dgy, dby;
-  double yr = 0.0, yg = 0.0, yb = 0.0,
-         xr = static_cast<double>(from.red()),
-         xg = static_cast<double>(from.green()),
-         xb = static_cast<double>(from.blue());
-
-  RGB *p = data;
-  unsigned int w = width * 2, h = height * 2;
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
-  unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red()   - from.red());
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue()  - from.blue());
+  RenderScope scope;
+  unsigned int * const alloc = scope.allocate<unsigned int>(width + height);
+  unsigned int * const xt = alloc;
+  unsigned int * const yt = alloc + width;
 
   // Create X table
-  drx /= w;
-  dgx /= w;
-  dbx /= w;
-
-  for (x = 0; x < width; ++x) {
-    xt[0][x] = static_cast<unsigned char>(xr);
-    xt[1][x] = static_cast<unsigned char>(xg);
-    xt[2][x] = static_cast<unsigned char>(xb);
-
-    xr += drx;
-    xg += dgx;
-    xb += dbx;
-  }
+  Ramp xr(Ramp::fixed(from.red()),
+          Ramp::fixed(from.green()),
+          Ramp::fixed(from.blue()),
+          dr, dg, db, width * 2);
+  for (x = 0; x < width; ++x, xr.next())
+    xt[x] = packRGB(xr.value(0), xr.value(1), xr.value(2));
 
   // Create Y table
-  dry /= h;
-  dgy /= h;
-  dby /= h;
-
-  for (y = 0; y < height; ++y) {
-    yt[0][y] = static_cast<unsigned char>(yr);
-    yt[1][y] = static_cast<unsigned char>(yg);
-    yt[2][y] = static_cast<unsigned char>(yb);
-
-    yr += dry;
-    yg += dgy;
-    yb += dby;
-  }
+  Ramp yr(0, 0, 0, dr, dg, db, height * 2);
+  for (y = 0; y < height; ++y, yr.next())
+    yt[y] = packRGB(yr.value(0), yr.value(1), yr.value(2));
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal dgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Add;
+  rows.data = data;
+  rows.width = width;
+  rows.xt = xt;
+  rows.yt = yt;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
 
 
 void bt::Image::hgradient(const Color &from, const Color &to,
                           bool interlaced) {
-  double drx, dgx, dbx,
-    xr = static_cast<double>(from.red()),
-    xg = static_cast<double>(from.green()),
-    xb = static_cast<double>(from.blue());
   RGB *p = data;
-  unsigned int total = width * (height - 2);
   unsigned int x;
 
-  drx = static_cast<double>(to.red()   - from.red());
-  dgx = static_cast<double>(to.green() - from.green());
-  dbx = static_cast<double>(to.blue()  - from.blue());
-
-  drx /= width;
-  dgx /= width;
-  dbx /= width;
-
-  if (interlaced && height > 1) {
-    // interlacing effect
-
-    // first line
-    for (x = 0; x < width; ++x, ++p) {
-      p->red   = static_cast<unsigned char>(xr);
-      p->green = static_cast<unsigned char>(xg);
-      p->blue  = static_cast<unsigned char>(xb);
-
-      xr += drx;
-      xg += dgx;
-      xb += dbx;
-    }
-
+  // first line
+  Ramp xr(Ramp::fixed(from.red()),
+          Ramp::fixed(from.green()),
+          Ramp::fixed(from.blue()),
+          to.red()   - from.red(),
+          to.green() - from.green(),
+          to.blue()  - from.blue(),
+          width);
+  for (x = 0; x < width; ++x, ++p, xr.next())
+    unpackRGB(p, packRGB(xr.value(0), xr.value(1), xr.value(2)));
+
+  if (height > 1) {
     // second line
-    xr = static_cast<double>(from.red()),
-    xg = static_cast<double>(from.green()),
-    xb = static_cast<double>(from.blue());
+    memcpy(p, data, width * sizeof(RGB));
 
-    for (x = 0; x < width; ++x, ++p) {
-      p->red   = static_cast<unsigned char>(xr);
-      p->green = static_cast<unsigned char>(xg);
-      p->blue  = static_cast<unsigned char>(xb);
-
-      p->red   = (p->red   >> 1) + (p->red   >> 2);
-      p->green = (p->green >> 1) + (p->green >> 2);
-      p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-
-      xr += drx;
-      xg += dgx;
-      xb += dbx;
-    }
-  } else {
-    // first line
-    for (x = 0; x < width; ++x, ++p) {
-      p->red   = static_cast<unsigned char>(xr);
-      p->green = static_cast<unsigned char>(xg);
-      p->blue  = static_cast<unsigned char>(xb);
-
-      xr += drx;
-      xg += dgx;
-      xb += dbx;
-    }
-
-    if (height > 1) {
-      // second line
-      memcpy(p, data, width * sizeof(RGB));
-      p += width;
-    }
+    // interlacing effect
+    if (interlaced)
+      kernels->interlace(p, width);
   }
 
-  if (height > 2) {
-    // rest of the gradient
-    for (x = 0; x < total; ++x)
-      p[x] = data[x];
-  }
+  // rest of the gradient
+  GradientRows rows;
+  rows.op = GradientRows::Copy;
+  rows.data = data;
+  rows.width = width;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
 }
 
 
 void bt::Image::vgradient(const Color &from, const Color &to,
                           bool interlaced) {
-  double dry, dgy, dby,
-    yr = static_cast<double>(from.red()  ),
-    yg = static_cast<double>(from.green()),
-    yb = static_cast<double>(from.blue() );
-  RGB *p = data;
-  unsigned int x, y;
+  unsigned int y;
 
-  dry = static_cast<double>(to.red()   - from.red()  );
-  dgy = static_cast<double>(to.green() - from.green());
-  dby = static_cast<double>(to.blue()  - from.blue() );
-
-  dry /= height;
-  dgy /= height;
-  dby /= height;
+  RenderScope scope;
+  unsigned int * const yt = scope.allocate<unsigned int>(height);
 
+  // Create Y table
+  Ramp yr(Ramp::fixed(from.red()),
+          Ramp::fixed(from.green()),
+          Ramp::fixed(from.blue()),
+          to.red()   - from.red(),
+          to.green() - from.green(),
+          to.blue()  - from.blue(),
+          height);
+  for (y = 0; y < height; ++y, yr.next())
+    yt[y] = packRGB(yr.value(0), yr.value(1), yr.value(2));
+
+  // interlacing effect
   if (interlaced) {
-    // faked interlacing effect
-    for (y = 0; y < height; ++y) {
-      const RGB rgb = {
-        static_cast<unsigned char>((y & 1) ? (yr * 3. / 4.) : yr),
-        static_cast<unsigned char>((y & 1) ? (yg * 3. / 4.) : yg),
-        static_cast<unsigned char>((y & 1) ? (yb * 3. / 4.) : yb),
-        0
-      };
-      for (x = 0; x < width; ++x, ++p)
-        *p = rgb;
-
-      yr += dry;
-      yg += dgy;
-      yb += dby;
-    }
-  } else {
-    // normal vgradient
-    for (y = 0; y < height; ++y) {
-      const RGB rgb = {
-        static_cast<unsigned char>(yr),
-        static_cast<unsigned char>(yg),
-        static_cast<unsigned char>(yb),
-        0
-      };
-      for (x = 0; x < width; ++x, ++p)
-        *p = rgb;
-
-      yr += dry;
-      yg += dgy;
-      yb += dby;
-    }
+    for (y = 1; y < height; y += 2)
+      yt[y] = interlacePacked(yt[y]);
   }
+
+  // Fill rows with the table
+  GradientRows rows;
+  rows.op = GradientRows::Fill;
+  rows.data = data;
+  rows.width = width;
+  rows.yt = yt;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
 }
 
 
@@ -1421,99 +3382,52 @@ void bt::Image::pgradient(const Color &from, const Color &to,
   // Mosfet (mosfet@kde.org)
   // adapted from kde sources for Blackbox by Brad Hughes
 
-  double yr, yg, yb, drx, dgx, dbx, dry, dgy, dby, xr, xg, xb;
-  int rsign, gsign, bsign;
-  RGB *p = data;
-  unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
+  const int rsign = (dr < 0) ? -1 : 1,
+            gsign = (dg < 0) ? -1 : 1,
+            bsign = (db < 0) ? -1 : 1;
+  const int tr = to.red(), tg = to.green(), tb = to.blue();
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
-  unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red()   - from.red());
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue()  - from.blue());
-
-  rsign = (drx < 0) ? -1 : 1;
-  gsign = (dgx < 0) ? -1 : 1;
-  bsign = (dbx < 0) ? -1 : 1;
+  RenderScope scope;
+  unsigned int * const alloc = scope.allocate<unsigned int>(width + height);
+  unsigned int * const xt = alloc;
+  unsigned int * const yt = alloc + width;
 
-  xr = yr = (drx / 2);
-  xg = yg = (dgx / 2);
-  xb = yb = (dbx / 2);
+  /*
+    each pixel is 'to - (sign * (x + y))', so the sign is folded into
+    both tables and the 'to' color into the Y table
+  */
 
   // Create X table
-  drx /= width;
-  dgx /= width;
-  dbx /= width;
-
-  for (x = 0; x < width; ++x) {
-    xt[0][x] = static_cast<unsigned char>(fabs(xr));
-    xt[1][x] = static_cast<unsigned char>(fabs(xg));
-    xt[2][x] = static_cast<unsigned char>(fabs(xb));
-
-    xr -= drx;
-    xg -= dgx;
-    xb -= dbx;
+  Ramp xr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, width);
+  for (x = 0; x < width; ++x, xr.next()) {
+    xt[x] = packRGB(-rsign * xr.absolute(0),
+                    -gsign * xr.absolute(1),
+                    -bsign * xr.absolute(2));
   }
 
   // Create Y table
-  dry /= height;
-  dgy /= height;
-  dby /= height;
-
-  for (y = 0; y < height; ++y) {
-    yt[0][y] = static_cast<unsigned char>(fabs(yr));
-    yt[1][y] = static_cast<unsigned char>(fabs(yg));
-    yt[2][y] = static_cast<unsigned char>(fabs(yb));
-
-    yr -= dry;
-    yg -= dgy;
-    yb -= dby;
+  Ramp yr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, height);
+  for (y = 0; y < height; ++y, yr.next()) {
+    yt[y] = packRGB(tr - rsign * yr.absolute(0),
+                    tg - gsign * yr.absolute(1),
+                    tb - bsign * yr.absolute(2));
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal pgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign * (xt[0][x] + yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign * (xt[1][x] + yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign * (xt[2][x] + yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign * (xt[0][x] + yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign * (xt[1][x] + yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign * (xt[2][x] + yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Add;
+  rows.data = data;
+  rows.width = width;
+  rows.xt = xt;
+  rows.yt = yt;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
 
 
@@ -1523,105 +3437,43 @@ void bt::Image::rgradient(const Color &from, const Color &to,
   // Mosfet (mosfet@kde.org)
   // adapted from kde sources for Blackbox by Brad Hughes
 
-  double drx, dgx, dbx, dry, dgy, dby, xr, xg, xb, yr, yg, yb;
-  int rsign, gsign, bsign;
-  RGB *p = data;
-  unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
+  const unsigned int tv = packRGB(to.red(), to.green(), to.blue());
+  const unsigned int neg = packRGB((dr < 0) ? 0xff : 0,
+                                   (dg < 0) ? 0xff : 0,
+                                   (db < 0) ? 0xff : 0);
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
-  unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red()   - from.red());
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue()  - from.blue());
-
-  rsign = (drx < 0) ? -2 : 2;
-  gsign = (dgx < 0) ? -2 : 2;
-  bsign = (dbx < 0) ? -2 : 2;
-
-  xr = yr = (drx / 2);
-  xg = yg = (dgx / 2);
-  xb = yb = (dbx / 2);
+  RenderScope scope;
+  unsigned int * const alloc = scope.allocate<unsigned int>(width + height);
+  unsigned int * const xt = alloc;
+  unsigned int * const yt = alloc + width;
 
   // Create X table
-  drx /= width;
-  dgx /= width;
-  dbx /= width;
-
-  for (x = 0; x < width; ++x) {
-    xt[0][x] = static_cast<unsigned char>(fabs(xr));
-    xt[1][x] = static_cast<unsigned char>(fabs(xg));
-    xt[2][x] = static_cast<unsigned char>(fabs(xb));
-
-    xr -= drx;
-    xg -= dgx;
-    xb -= dbx;
-  }
+  Ramp xr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, width);
+  for (x = 0; x < width; ++x, xr.next())
+    xt[x] = packRGB(xr.absolute(0), xr.absolute(1), xr.absolute(2));
 
   // Create Y table
-  dry /= height;
-  dgy /= height;
-  dby /= height;
-
-  for (y = 0; y < height; ++y) {
-    yt[0][y] = static_cast<unsigned char>(fabs(yr));
-    yt[1][y] = static_cast<unsigned char>(fabs(yg));
-    yt[2][y] = static_cast<unsigned char>(fabs(yb));
-
-    yr -= dry;
-    yg -= dgy;
-    yb -= dby;
-  }
+  Ramp yr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, height);
+  for (y = 0; y < height; ++y, yr.next())
+    yt[y] = packRGB(yr.absolute(0), yr.absolute(1), yr.absolute(2));
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal rgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::max(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::max(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::max(xt[2][x], yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::max(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::max(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::max(xt[2][x], yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Max;
+  rows.data = data;
+  rows.width = width;
+  rows.xt = xt;
+  rows.yt = yt;
+  rows.to = tv;
+  rows.neg = neg;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
 
 
@@ -1631,105 +3483,59 @@ void bt::Image::egradient(const Color &from, const Color &to,
   // Mosfet (mosfet@kde.org)
   // adapted from kde sources for Blackbox by Brad Hughes
 
-  double drx, dgx, dbx, dry, dgy, dby, yr, yg, yb, xr, xg, xb;
-  int rsign, gsign, bsign;
-  RGB *p = data;
-  unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
+  const unsigned int tv = packRGB(to.red(), to.green(), to.blue());
+  const unsigned int neg = packRGB((dr < 0) ? 0xff : 0,
+                                   (dg < 0) ? 0xff : 0,
+                                   (db < 0) ? 0xff : 0);
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
+  RenderScope scope;
+  unsigned int * const alloc =
+    scope.allocate<unsigned int>((width + height) * 3);
   unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red() - from.red());
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue() - from.blue());
-
-  rsign = (drx < 0) ? -1 : 1;
-  gsign = (dgx < 0) ? -1 : 1;
-  bsign = (dbx < 0) ? -1 : 1;
-
-  xr = yr = (drx / 2);
-  xg = yg = (dgx / 2);
-  xb = yb = (dbx / 2);
+  xt[0] = alloc + (width * 0);
+  xt[1] = alloc + (width * 1);
+  xt[2] = alloc + (width * 2);
+  yt[0] = alloc + (width * 3) + (height * 0);
+  yt[1] = alloc + (width * 3) + (height * 1);
+  yt[2] = alloc + (width * 3) + (height * 2);
 
   // Create X table
-  drx /= width;
-  dgx /= width;
-  dbx /= width;
-
-  for (x = 0; x < width; x++) {
-    xt[0][x] = static_cast<unsigned int>(xr * xr);
-    xt[1][x] = static_cast<unsigned int>(xg * xg);
-    xt[2][x] = static_cast<unsigned int>(xb * xb);
-
-    xr -= drx;
-    xg -= dgx;
-    xb -= dbx;
+  Ramp xr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, width);
+  for (x = 0; x < width; ++x, xr.next()) {
+    xt[0][x] = xr.square(0);
+    xt[1][x] = xr.square(1);
+    xt[2][x] = xr.square(2);
   }
 
   // Create Y table
-  dry /= height;
-  dgy /= height;
-  dby /= height;
-
-  for (y = 0; y < height; y++) {
-    yt[0][y] = static_cast<unsigned int>(yr * yr);
-    yt[1][y] = static_cast<unsigned int>(yg * yg);
-    yt[2][y] = static_cast<unsigned int>(yb * yb);
-
-    yr -= dry;
-    yg -= dgy;
-    yb -= dby;
+  Ramp yr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, height);
+  for (y = 0; y < height; ++y, yr.next()) {
+    yt[0][y] = yr.square(0);
+    yt[1][y] = yr.square(1);
+    yt[2][y] = yr.square(2);
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal egradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = static_cast<unsigned char>
-                   (tr - (rsign * static_cast<int>(sqrt(xt[0][x] +
-                                                        yt[0][y]))));
-        p->green = static_cast<unsigned char>
-                   (tg - (gsign * static_cast<int>(sqrt(xt[1][x] +
-                                                        yt[1][y]))));
-        p->blue  = static_cast<unsigned char>
-                   (tb - (bsign * static_cast<int>(sqrt(xt[2][x] +
-                                                        yt[2][y]))));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = static_cast<unsigned char>
-                   (tr - (rsign * static_cast<int>(sqrt(xt[0][x]
-                                                        + yt[0][y]))));
-        p->green = static_cast<unsigned char>
-                   (tg - (gsign * static_cast<int>(sqrt(xt[1][x]
-                                                        + yt[1][y]))));
-        p->blue  = static_cast<unsigned char>
-                   (tb - (bsign * static_cast<int>(sqrt(xt[2][x]
-                                                        + yt[2][y]))));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Sqrt;
+  rows.data = data;
+  rows.width = width;
+  rows.xtc[0] = xt[0];
+  rows.xtc[1] = xt[1];
+  rows.xtc[2] = xt[2];
+  rows.ytc[0] = yt[0];
+  rows.ytc[1] = yt[1];
+  rows.ytc[2] = yt[2];
+  rows.to = tv;
+  rows.neg = neg;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
 
 
@@ -1739,105 +3545,43 @@ void bt::Image::pcgradient(const Color &from, const Color &to,
   // Mosfet (mosfet@kde.org)
   // adapted from kde sources for Blackbox by Brad Hughes
 
-  double drx, dgx, dbx, dry, dgy, dby, xr, xg, xb, yr, yg, yb;
-  int rsign, gsign, bsign;
-  RGB *p = data;
-  unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
+  const unsigned int tv = packRGB(to.red(), to.green(), to.blue());
+  const unsigned int neg = packRGB((dr < 0) ? 0xff : 0,
+                                   (dg < 0) ? 0xff : 0,
+                                   (db < 0) ? 0xff : 0);
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
-  unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red()   - from.red());
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue()  - from.blue());
-
-  rsign = (drx < 0) ? -2 : 2;
-  gsign = (dgx < 0) ? -2 : 2;
-  bsign = (dbx < 0) ? -2 : 2;
-
-  xr = yr = (drx / 2);
-  xg = yg = (dgx / 2);
-  xb = yb = (dbx / 2);
+  RenderScope scope;
+  unsigned int * const alloc = scope.allocate<unsigned int>(width + height);
+  unsigned int * const xt = alloc;
+  unsigned int * const yt = alloc + width;
 
   // Create X table
-  drx /= width;
-  dgx /= width;
-  dbx /= width;
-
-  for (x = 0; x < width; ++x) {
-    xt[0][x] = static_cast<unsigned char>(fabs(xr));
-    xt[1][x] = static_cast<unsigned char>(fabs(xg));
-    xt[2][x] = static_cast<unsigned char>(fabs(xb));
-
-    xr -= drx;
-    xg -= dgx;
-    xb -= dbx;
-  }
+  Ramp xr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, width);
+  for (x = 0; x < width; ++x, xr.next())
+    xt[x] = packRGB(xr.absolute(0), xr.absolute(1), xr.absolute(2));
 
   // Create Y table
-  dry /= height;
-  dgy /= height;
-  dby /= height;
-
-  for (y = 0; y < height; ++y) {
-    yt[0][y] = static_cast<unsigned char>(fabs(yr));
-    yt[1][y] = static_cast<unsigned char>(fabs(yg));
-    yt[2][y] = static_cast<unsigned char>(fabs(yb));
-
-    yr -= dry;
-    yg -= dgy;
-    yb -= dby;
-  }
+  Ramp yr(dr * 32768, dg * 32768, db * 32768, -dr, -dg, -db, height);
+  for (y = 0; y < height; ++y, yr.next())
+    yt[y] = packRGB(yr.absolute(0), yr.absolute(1), yr.absolute(2));
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal rgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::min(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::min(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::min(xt[2][x], yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::min(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::min(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::min(xt[2][x], yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Min;
+  rows.data = data;
+  rows.width = width;
+  rows.xt = xt;
+  rows.yt = yt;
+  rows.to = tv;
+  rows.neg = neg;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
 
 
@@ -1847,90 +3591,38 @@ void bt::Image::cdgradient(const Color &from, const Color &to,
   // Mosfet (mosfet@kde.org)
   // adapted from kde sources for Blackbox by Brad Hughes
 
-  double drx, dgx, dbx, dry, dgy, dby;
-  double yr = 0.0, yg = 0.0, yb = 0.0,
-         xr = static_cast<double>(from.red()  ),
-         xg = static_cast<double>(from.green()),
-         xb = static_cast<double>(from.blue() );
-  RGB *p = data;
-  unsigned int w = width * 2, h = height * 2;
+  const int dr = to.red()   - from.red(),
+            dg = to.green() - from.green(),
+            db = to.blue()  - from.blue();
   unsigned int x, y;
 
-  const unsigned int dimension = std::max(width, height);
-  unsigned int *alloc = new unsigned int[dimension * 6];
-  unsigned int *xt[3], *yt[3];
-  xt[0] = alloc + (dimension * 0);
-  xt[1] = alloc + (dimension * 1);
-  xt[2] = alloc + (dimension * 2);
-  yt[0] = alloc + (dimension * 3);
-  yt[1] = alloc + (dimension * 4);
-  yt[2] = alloc + (dimension * 5);
-
-  dry = drx = static_cast<double>(to.red()   - from.red()  );
-  dgy = dgx = static_cast<double>(to.green() - from.green());
-  dby = dbx = static_cast<double>(to.blue()  - from.blue() );
-
-  // Create X table
-  drx /= w;
-  dgx /= w;
-  dbx /= w;
-
-  for (x = width - 1; x != 0; --x) {
-    xt[0][x] = static_cast<unsigned char>(xr);
-    xt[1][x] = static_cast<unsigned char>(xg);
-    xt[2][x] = static_cast<unsigned char>(xb);
-
-    xr += drx;
-    xg += dgx;
-    xb += dbx;
-  }
+  RenderScope scope;
+  unsigned int * const alloc = scope.allocate<unsigned int>(width + height);
+  unsigned int * const xt = alloc;
+  unsigned int * const yt = alloc + width;
 
-  xt[0][x] = static_cast<unsigned char>(xr);
-  xt[1][x] = static_cast<unsigned char>(xg);
-  xt[2][x] = static_cast<unsigned char>(xb);
+  // Create X table, from right to left
+  Ramp xr(Ramp::fixed(from.red()),
+          Ramp::fixed(from.green()),
+          Ramp::fixed(from.blue()),
+          dr, dg, db, width * 2);
+  for (x = width; x-- > 0; xr.next())
+    xt[x] = packRGB(xr.value(0), xr.value(1), xr.value(2));
 
   // Create Y table
-  dry /= h;
-  dgy /= h;
-  dby /= h;
-
-  for (y = 0; y < height; ++y) {
-    yt[0][y] = static_cast<unsigned char>(yr);
-    yt[1][y] = static_cast<unsigned char>(yg);
-    yt[2][y] = static_cast<unsigned char>(yb);
-
-    yr += dry;
-    yg += dgy;
-    yb += dby;
-  }
+  Ramp yr(0, 0, 0, dr, dg, db, height * 2);
+  for (y = 0; y < height; ++y, yr.next())
+    yt[y] = packRGB(yr.value(0), yr.value(1), yr.value(2));
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal dgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
-
-  delete [] alloc;
+  GradientRows rows;
+  rows.op = GradientRows::Add;
+  rows.data = data;
+  rows.width = width;
+  rows.xt = xt;
+  rows.yt = yt;
+  renderBands(renderGradientRows, &rows, width, height, 1u);
+
+  if (interlaced)
+    interlace(data, width, height);
 }
@@ -42,11 +42,29 @@ namespace bt {
     FloydSteinbergDither
   };
 
+  /*
+    The kernels used to render gradients.  The SIMD kernels are only
+    used when the CPU supports them, and produce output that is
+    bit-identical to the scalar kernels.
+  */
+  enum RenderKernel {
+    AutomaticKernel,
+    ScalarKernel,
+    SSE2Kernel,
+    AVX2Kernel
+  };
+
+  /*
+    One pixel of a rendered image, 32 bits with the channels in byte
+    order.  The channels are plain bytes (not bitfields), so reads and
+    writes are single byte loads and stores that the compiler can
+    vectorize.
+  */
   struct RGB {
-    unsigned int red      : 8;
-    unsigned int green    : 8;
-    unsigned int blue     : 8;
-    unsigned int reserved : 8;
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char reserved;
   };
 
   class Image : public NoCopy {
@@ -61,6 +79,59 @@ namespace bt {
     static inline void setDitherMode(DitherMode dithermode)
     { global_ditherMode = dithermode; }
 
+    /*
+      Returns the kernel used to render gradients.  This is never
+      AutomaticKernel, but the best kernel supported by the CPU.
+    */
+    static RenderKernel renderKernel(void);
+    /*
+      Requests a specific kernel to render gradients.  If the CPU does
+      not support the requested kernel, the next best one is used.
+    */
+    static void setRenderKernel(RenderKernel kernel);
+
+    /*
+      Images with at least this many pixels are split into horizontal
+      bands, which are rendered in parallel by a pool of worker
+      threads.  A threshold of zero disables threaded rendering.  This
+      has no effect if libbt was built without thread support.
+    */
+    static inline unsigned int renderThreshold(void)
+    { return global_renderThreshold; }
+    static inline void setRenderThreshold(unsigned int pixels)
+    { global_renderThreshold = pixels; }
+
+    /*
+      Gradients with at least this many pixels are saved in
+      $XDG_CACHE_HOME/blackbox after rendering, and read back from
+      there instead of being rendered again (for example, after a
+      restart).  A threshold of zero (the default) disables the cache.
+    */
+    static inline unsigned int cacheThreshold(void)
+    { return global_cacheThreshold; }
+    static inline void setCacheThreshold(unsigned int pixels)
+    { global_cacheThreshold = pixels; }
+
+    /*
+      The most disk space, in kilobytes, used by the image cache.  The
+      oldest images are removed when a new one does not fit.
+    */
+    static inline unsigned int cacheSize(void)
+    { return global_cacheSize; }
+    static inline void setCacheSize(unsigned int kilobytes)
+    { global_cacheSize = kilobytes; }
+
+    /*
+      Turns writing to the image cache off and on.  Images are still
+      read from the cache while writes are off.  This is used while
+      resizing windows, since the sizes in between are not worth
+      keeping.
+    */
+    static inline bool cacheWrites(void)
+    { return global_cacheWrites; }
+    static inline void setCacheWrites(bool writes)
+    { global_cacheWrites = writes; }
+
     Image(unsigned int w, unsigned int h);
     ~Image(void);
 
@@ -82,6 +153,8 @@ namespace bt {
 
     Pixmap renderPixmap(const Display &display, unsigned int screen);
 
+    void renderGradient(const Texture &texture);
+
     void raisedBevel(unsigned int border_width = 0);
     void sunkenBevel(unsigned int border_width = 0);
     void dgradient(const Color &from, const Color &to, bool interlaced);
@@ -95,6 +168,11 @@ namespace bt {
 
     static unsigned int global_maximumColors;
     static DitherMode global_ditherMode;
+    static RenderKernel global_renderKernel;
+    static unsigned int global_renderThreshold;
+    static unsigned int global_cacheThreshold;
+    static unsigned int global_cacheSize;
+    static bool global_cacheWrites;
   };
 
 } // namespace bt
@@ -209,11 +209,13 @@ void bt::MenuStyle::drawItem(Window window, const Rect &rect,
 
   Pen fpen(_screen, (item.isEnabled() ? (item.isActive() ? active.foreground :
                                          frame.foreground) : frame.disabled));
-  Pen tpen(_screen, (item.isEnabled() ? (item.isActive() ? active.text :
-                                         frame.text) : frame.disabled));
   if (item.isActive() && item.isEnabled())
     drawTexture(_screen, active.texture, window, rect, rect, pixmap);
-  drawText(frame.font, tpen, window, r2, frame.alignment, item.label());
+  item.layout.update(_screen, frame.font,
+                     (item.isEnabled() ? (item.isActive() ? active.text :
+                                          frame.text) : frame.disabled),
+                     r2, frame.alignment, item.label());
+  item.layout.draw(window);
 
   if (item.isChecked()) {
     drawBitmap(bt::Bitmap::checkMark(_screen), fpen, window,
@@ -88,8 +88,10 @@ namespace bt {
     unsigned int title     : 1;
     unsigned int enabled   : 1;
     unsigned int checked   : 1;
+    mutable TextLayout layout;
 
     friend class Menu;
+    friend class MenuStyle;
   };
 
 
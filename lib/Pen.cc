@@ -28,6 +28,8 @@
 #include "Util.hh"
 
 #include <algorithm>
+#include <list>
+#include <map>
 
 #include <X11/Xlib.h>
 #ifdef XFT
@@ -37,6 +39,8 @@
 #include <assert.h>
 #include <stdio.h>
 
+// #define PENCACHE_DEBUG
+
 namespace bt {
 
   class PenLoader
@@ -52,42 +56,352 @@ namespace bt {
     { return _display.XDisplay(); }
   };
 
+  class PenCacheItem {
+  public:
+    struct Key {
+      unsigned int screen;
+      unsigned long pixel;
+      int function;
+      int linewidth;
+      int subwindow;
+
+      inline bool operator<(const Key &x) const {
+        if (screen != x.screen)
+          return screen < x.screen;
+        if (pixel != x.pixel)
+          return pixel < x.pixel;
+        if (function != x.function)
+          return function < x.function;
+        if (linewidth != x.linewidth)
+          return linewidth < x.linewidth;
+        return subwindow < x.subwindow;
+      }
+    };
+
+    typedef std::list<PenCacheItem *> List;
+
+    inline PenCacheItem(const Key &k, GC g)
+      : key(k), gc(g), count(1u)
+    { }
+
+    const Key key;
+    const GC gc;
+    unsigned int count;
+    // position in the idle list, valid while count is zero
+    List::iterator idle;
+  };
+
+
+  class PenCache {
+  public:
+    enum {
+      // unused GCs kept in the cache
+      MaximumUnused = 32u
+    };
+
+    PenCache(const Display &display)
+      : _display(display)
+    { }
+    ~PenCache(void)
+    { clear(true); }
+
+    /*
+      Finds a GC with the given values, creating it if needed.  The
+      item is reference counted.
+    */
+    PenCacheItem *find(const PenCacheItem::Key &key);
+    /*
+      Releases the item.  GCs with a zero reference count are kept
+      until clear() is called, or until there are more than
+      MaximumUnused of them, in which case the one that has been
+      unused the longest is freed.
+    */
+    void release(PenCacheItem *item);
+
+    /*
+      Frees all GCs with a zero reference count, or all GCs if force
+      is true.
+    */
+    void clear(bool force);
+
+  private:
+    const Display &_display;
+
+    typedef std::map<PenCacheItem::Key, PenCacheItem *> Cache;
+    Cache cache;
+    // GCs with a zero reference count, most recently released first
+    PenCacheItem::List idle;
+
+    void free(Cache::iterator it);
+  };
+
+
+  PenCacheItem *PenCache::find(const PenCacheItem::Key &key) {
+    Cache::iterator it = cache.find(key);
+    if (it != cache.end()) {
+      PenCacheItem * const item = it->second;
+      if (item->count++ == 0u)
+        idle.erase(item->idle);
+      return item;
+    }
+
+    XGCValues gcv;
+    gcv.foreground = key.pixel;
+    gcv.function = key.function;
+    gcv.line_width = key.linewidth;
+    gcv.subwindow_mode = key.subwindow;
+    const GC gc = XCreateGC(_display.XDisplay(),
+                            _display.screenInfo(key.screen).rootWindow(),
+                            (GCForeground
+                             | GCFunction
+                             | GCLineWidth
+                             | GCSubwindowMode),
+                            &gcv);
+
+#ifdef PENCACHE_DEBUG
+    fprintf(stderr, "bt::PenCache: add pixel %08lx, function %d, "
+            "linewidth %d, subwindow %d\n",
+            key.pixel, key.function, key.linewidth, key.subwindow);
+#endif // PENCACHE_DEBUG
+
+    PenCacheItem * const item = new PenCacheItem(key, gc);
+    cache.insert(Cache::value_type(key, item));
+    return item;
+  }
+
+
+  void PenCache::release(PenCacheItem *item) {
+    assert(item->count > 0u);
+    if (--item->count > 0u)
+      return;
+
+    idle.push_front(item);
+    item->idle = idle.begin();
+    if (idle.size() > MaximumUnused)
+      free(cache.find(idle.back()->key));
+  }
+
+
+  void PenCache::free(Cache::iterator it) {
+    PenCacheItem * const item = it->second;
+    if (item->count == 0u)
+      idle.erase(item->idle);
+
+#ifdef PENCACHE_DEBUG
+    fprintf(stderr, "bt::PenCache: fre pixel %08lx, function %d, "
+            "linewidth %d, subwindow %d\n",
+            item->key.pixel, item->key.function, item->key.linewidth,
+            item->key.subwindow);
+#endif // PENCACHE_DEBUG
+
+    XFreeGC(_display.XDisplay(), item->gc);
+    delete item;
+    cache.erase(it);
+  }
+
+
+  void PenCache::clear(bool force) {
+    Cache::iterator it = cache.begin();
+    while (it != cache.end()) {
+      if (it->second->count != 0u && !force) {
+        ++it;
+        continue;
+      }
+      free(it++);
+    }
+  }
+
+
+#ifdef XFT
+  /*
+    XftDraws are keyed by drawable, since creating one also creates a
+    Render picture on the server.  Entries are removed when the
+    drawable goes away, see releaseXftDraw() below.
+  */
+  class XftDrawCache {
+  public:
+    enum {
+      // drawables kept in the cache
+      MaximumSize = 512u
+    };
+
+    XftDrawCache(const Display &display)
+      : _display(display)
+    { }
+    ~XftDrawCache(void)
+    { clear(); }
+
+    XftDraw *find(unsigned int screen, Drawable drawable);
+    // frees the XftDraw for a drawable that is about to be destroyed
+    void release(Drawable drawable);
+    /*
+      Drops the XftDraw for a drawable that has already been
+      destroyed.  The server freed its picture along with the
+      drawable, so XftDrawDestroy() would only cause a BadPicture
+      error; the small client side structure is leaked instead.
+    */
+    void forget(Drawable drawable);
+    void clear(void);
+
+  private:
+    const Display &_display;
+
+    // most recently used first
+    typedef std::list<std::pair<Drawable, XftDraw *> > List;
+    typedef std::map<Drawable, List::iterator> Cache;
+    List list;
+    Cache cache;
+
+    void free(Cache::iterator it);
+  };
+
+
+  XftDraw *XftDrawCache::find(unsigned int screen, Drawable drawable) {
+    Cache::iterator it = cache.find(drawable);
+    if (it != cache.end()) {
+      list.splice(list.begin(), list, it->second);
+      return it->second->second;
+    }
+
+    // drawables destroyed without notice would otherwise accumulate
+    if (cache.size() >= MaximumSize)
+      free(cache.find(list.back().first));
+
+    const ScreenInfo &screeninfo = _display.screenInfo(screen);
+    XftDraw * const xftdraw = XftDrawCreate(_display.XDisplay(),
+                                            drawable,
+                                            screeninfo.visual(),
+                                            screeninfo.colormap());
+    assert(xftdraw != 0);
+
+#ifdef PENCACHE_DEBUG
+    fprintf(stderr, "bt::XftDrawCache: add drawable %08lx\n", drawable);
+#endif // PENCACHE_DEBUG
+
+    list.push_front(List::value_type(drawable, xftdraw));
+    cache.insert(Cache::value_type(drawable, list.begin()));
+    return xftdraw;
+  }
+
+
+  void XftDrawCache::release(Drawable drawable) {
+    Cache::iterator it = cache.find(drawable);
+    if (it != cache.end())
+      free(it);
+  }
+
+
+  void XftDrawCache::forget(Drawable drawable) {
+    Cache::iterator it = cache.find(drawable);
+    if (it == cache.end())
+      return;
+
+#ifdef PENCACHE_DEBUG
+    fprintf(stderr, "bt::XftDrawCache: fgt drawable %08lx\n", drawable);
+#endif // PENCACHE_DEBUG
+
+    list.erase(it->second);
+    cache.erase(it);
+  }
+
+
+  void XftDrawCache::free(Cache::iterator it) {
+#ifdef PENCACHE_DEBUG
+    fprintf(stderr, "bt::XftDrawCache: fre drawable %08lx\n", it->first);
+#endif // PENCACHE_DEBUG
+
+    XftDrawDestroy(it->second->second);
+    list.erase(it->second);
+    cache.erase(it);
+  }
+
+
+  void XftDrawCache::clear(void) {
+    while (!cache.empty())
+      free(cache.begin());
+  }
+#endif // XFT
+
+
   static PenLoader *penloader = 0;
+  static PenCache *pencache = 0;
+#ifdef XFT
+  static XftDrawCache *xftdrawcache = 0;
+#endif
 
   void createPenLoader(const Display &display)
   {
     assert(penloader == 0);
     penloader = new PenLoader(display);
+    pencache = new PenCache(display);
+#ifdef XFT
+    xftdrawcache = new XftDrawCache(display);
+#endif
   }
   void destroyPenLoader(void)
   {
+#ifdef XFT
+    delete xftdrawcache;
+    xftdrawcache = 0;
+#endif
+    delete pencache;
+    pencache = 0;
     delete penloader;
     penloader = 0;
   }
 
+  /*
+    Called by Application when a window's event handler is removed,
+    which happens right before the window is destroyed.
+  */
+  void releaseXftDraw(Drawable drawable)
+  {
+#ifdef XFT
+    if (xftdrawcache)
+      xftdrawcache->release(drawable);
+#else
+    (void) drawable;
+#endif
+  }
+
+  /*
+    Called by Application on DestroyNotify, for windows destroyed
+    without removing their event handler first.  Normally there is
+    nothing left to forget.
+  */
+  void forgetXftDraw(Drawable drawable)
+  {
+#ifdef XFT
+    if (xftdrawcache)
+      xftdrawcache->forget(drawable);
+#else
+    (void) drawable;
+#endif
+  }
+
 } // namespace bt
 
+void bt::Pen::clearCache(void)
+{
+  if (pencache)
+    pencache->clear(false);
+}
+
 bt::Pen::Pen(unsigned int screen_)
   : _screen(screen_), _function(GXcopy),  _linewidth(0),
-    _subwindow(ClipByChildren), _dirty(false), _gc(0), _xftdraw(0)
+    _subwindow(ClipByChildren), _dirty(false), _item(0)
 { }
 
 bt::Pen::Pen(unsigned int screen_, const Color &color_)
   : _screen(screen_), _color(color_), _function(GXcopy), _linewidth(0),
-    _subwindow(ClipByChildren), _dirty(false), _gc(0), _xftdraw(0)
+    _subwindow(ClipByChildren), _dirty(false), _item(0)
 { }
 
 bt::Pen::~Pen(void)
 {
-  if (_gc)
-    XFreeGC(penloader->XDisplay(), _gc);
-  _gc = 0;
-
-#ifdef XFT
-  if (_xftdraw)
-    XftDrawDestroy(_xftdraw);
-  _xftdraw = 0;
-#endif
+  if (_item)
+    pencache->release(_item);
+  _item = 0;
 }
 
 void bt::Pen::setColor(const Color &color_)
@@ -122,52 +436,30 @@ const bt::Display &bt::Pen::display(void) const
 
 const GC &bt::Pen::gc(void) const
 {
-  if (!_gc || _dirty) {
-    XGCValues gcv;
-    gcv.foreground = _color.pixel(_screen);
-    gcv.function = _function;
-    gcv.line_width = _linewidth;
-    gcv.subwindow_mode = _subwindow;
-    if (!_gc) {
-      _gc = XCreateGC(penloader->XDisplay(),
-                      penloader->display().screenInfo(_screen).rootWindow(),
-                      (GCForeground
-                       | GCFunction
-                       | GCLineWidth
-                       | GCSubwindowMode),
-                      &gcv);
-
-    } else {
-      XChangeGC(penloader->XDisplay(),
-                _gc,
-                (GCForeground
-                 | GCFunction
-                 | GCLineWidth
-                 | GCSubwindowMode),
-                &gcv);
-    }
+  if (!_item || _dirty) {
+    PenCacheItem::Key key;
+    key.screen = _screen;
+    key.pixel = _color.pixel(_screen);
+    key.function = _function;
+    key.linewidth = _linewidth;
+    key.subwindow = _subwindow;
+
+    PenCacheItem * const item = pencache->find(key);
+    if (_item)
+      pencache->release(_item);
+    _item = item;
     _dirty = false;
   }
-  assert(_gc != 0);
-  return _gc;
+  assert(_item != 0);
+  return _item->gc;
 }
 
 XftDraw *bt::Pen::xftDraw(Drawable drawable) const
 {
 #ifdef XFT
-  if (!_xftdraw) {
-    const ScreenInfo &screeninfo = penloader->display().screenInfo(_screen);
-    _xftdraw = XftDrawCreate(penloader->XDisplay(),
-                             drawable,
-                             screeninfo.visual(),
-                             screeninfo.colormap());
-  } else if (XftDrawDrawable(_xftdraw) != drawable) {
-    XftDrawChange(_xftdraw, drawable);
-  }
-  assert(_xftdraw != 0);
-  return _xftdraw;
+  return xftdrawcache->find(_screen, drawable);
 #else
+  (void) drawable;
   return 0;
 #endif
 }
-
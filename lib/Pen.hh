@@ -34,9 +34,23 @@ namespace bt {
 
   // forward declarations
   class Display;
+  class PenCacheItem;
 
+  /*
+    Pens are cheap to create.  GCs are shared between all pens with
+    the same screen, color, function, line width and subwindow mode,
+    and are kept in a cache after the last pen using them is gone.
+    Code that changes other GC values (like the clip mask) must
+    restore them before the pen is used again.  XftDraws are likewise
+    shared per drawable and live until the drawable is destroyed.
+  */
   class Pen : public NoCopy {
   public:
+    /*
+      Frees unused GCs on all screens.
+    */
+    static void clearCache(void);
+
     Pen(unsigned int screen_);
     Pen(unsigned int screen_, const Color &color_);
     ~Pen(void);
@@ -66,8 +80,7 @@ namespace bt {
     int _subwindow;
 
     mutable bool _dirty;
-    mutable GC _gc;
-    mutable XftDraw *_xftdraw;
+    mutable PenCacheItem *_item;
   };
 
 } // namespace bt
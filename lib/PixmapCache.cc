@@ -26,20 +26,94 @@
 #include "PixmapCache.hh"
 #include "Display.hh"
 #include "Image.hh"
+#include "Pen.hh"
 #include "Texture.hh"
 
 #include <X11/Xlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 #include <algorithm>
 #include <list>
+#include <vector>
 
 // #define PIXMAPCACHE_DEBUG
 
 
 namespace bt {
 
+  /*
+    A chained hash table of iterators into a container.  The caller
+    computes the hash value and decides which entries match.
+  */
+  template <class Iterator>
+  class HashIndex {
+  public:
+    inline HashIndex(void)
+      : buckets(16), count(0u)
+    { }
+
+    void insert(unsigned long hash, Iterator it) {
+      if (count >= buckets.size() * 2u)
+        rehash(buckets.size() * 2u);
+      buckets[hash & (buckets.size() - 1u)].push_back(Entry(hash, it));
+      ++count;
+    }
+
+    void erase(unsigned long hash, Iterator it) {
+      Bucket &bucket = buckets[hash & (buckets.size() - 1u)];
+      typename Bucket::iterator e = bucket.begin(), end = bucket.end();
+      for (; e != end; ++e) {
+        if (e->second != it)
+          continue;
+        *e = bucket.back();
+        bucket.pop_back();
+        --count;
+        return;
+      }
+      assert(false); // not reached
+    }
+
+    template <class Match>
+    bool find(unsigned long hash, const Match &match, Iterator &it) const {
+      const Bucket &bucket = buckets[hash & (buckets.size() - 1u)];
+      typename Bucket::const_iterator e = bucket.begin(), end = bucket.end();
+      for (; e != end; ++e) {
+        if (e->first == hash && match(*e->second)) {
+          it = e->second;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void clear(void) {
+      buckets.clear();
+      buckets.resize(16);
+      count = 0u;
+    }
+
+  private:
+    typedef std::pair<unsigned long, Iterator> Entry;
+    typedef std::vector<Entry> Bucket;
+
+    void rehash(size_t size) {
+      std::vector<Bucket> old(size);
+      old.swap(buckets);
+      typename std::vector<Bucket>::const_iterator b = old.begin();
+      for (; b != old.end(); ++b) {
+        typename Bucket::const_iterator e = b->begin();
+        for (; e != b->end(); ++e)
+          buckets[e->first & (size - 1u)].push_back(*e);
+      }
+    }
+
+    std::vector<Bucket> buckets;
+    size_t count;
+  };
+
+
   class RealPixmapCache {
   public:
     RealPixmapCache(const Display &display);
@@ -52,23 +126,28 @@ namespace bt {
     void release(Pixmap pixmap);
 
     void clear(bool force);
+    void evict(void);
+
+    Pixmap renderSolidTile(unsigned int screen, const Texture &texture,
+                           unsigned int width, unsigned int height);
 
     struct CacheItem {
       const Texture texture;
       const unsigned int screen;
       const unsigned int width;
       const unsigned int height;
+      const unsigned long hash;
       Pixmap pixmap;
       unsigned int count;
 
       inline CacheItem(void)
-        : screen(~0u), width(0u), height(0u),
+        : screen(~0u), width(0u), height(0u), hash(0ul),
           pixmap(0ul), count(0u)
       { }
       inline CacheItem(const unsigned int s, const Texture &t,
                        const unsigned int w, const unsigned int h)
         : texture(t), screen(s), width(w), height(h),
-          pixmap(0ul), count(1u)
+          hash(hashItem(s, t, w, h)), pixmap(0ul), count(1u)
       { }
 
       inline bool operator==(const CacheItem &x) const {
@@ -79,6 +158,16 @@ namespace bt {
       }
     };
 
+    struct ItemMatch {
+      inline ItemMatch(const CacheItem &i)
+        : item(i)
+      { }
+      inline bool operator()(const RealPixmapCache::CacheItem& x) const
+      { return x == item; }
+
+      const CacheItem &item;
+    };
+
     struct PixmapMatch {
       inline PixmapMatch(Pixmap p)
         : pixmap(p)
@@ -89,16 +178,42 @@ namespace bt {
       const Pixmap pixmap;
     };
 
+    // the server side size of a pixmap, in bytes
+    unsigned long pixmapSize(unsigned int screen,
+                             unsigned int width, unsigned int height) const;
+
+    static unsigned long hashItem(unsigned int screen, const Texture &texture,
+                                  unsigned int width, unsigned int height);
+    static inline unsigned long hashPixmap(Pixmap pixmap)
+    { return pixmap * 2654435761ul; }
+
     const Display &_display;
 
+    // pixmap formats supported by the X server
+    struct PixmapFormat {
+      unsigned int depth;
+      unsigned int bits_per_pixel;
+      unsigned int scanline_pad;
+    };
+    std::vector<PixmapFormat> formats;
+
+    // most recently used first
     typedef std::list<CacheItem> Cache;
     Cache cache;
+
+    Cache::iterator remove(Cache::iterator it);
+
+    // indexed by texture, screen and size
+    HashIndex<Cache::iterator> items;
+    // indexed by pixmap
+    HashIndex<Cache::iterator> pixmaps;
   };
 
 
   static RealPixmapCache *realpixmapcache = 0;
   static unsigned long maxmem_usage = 2ul*1024ul*1024ul; // 2mb default
   static unsigned long mem_usage = 0ul;
+  static PixmapCache::Statistics stats = { 0ul, 0ul, 0ul, 0ul, 0ul, 0ul };
 
 
   void createPixmapCache(const Display &display) {
@@ -119,7 +234,24 @@ namespace bt {
 
 bt::RealPixmapCache::RealPixmapCache(const Display &display)
   : _display(display)
-{ }
+{
+  int count = 0;
+  XPixmapFormatValues *list = XListPixmapFormats(_display.XDisplay(), &count);
+  for (int i = 0; i < count; ++i) {
+    PixmapFormat format;
+    format.depth = list[i].depth;
+    format.bits_per_pixel = list[i].bits_per_pixel;
+    format.scanline_pad = list[i].scanline_pad;
+    formats.push_back(format);
+
+#ifdef PIXMAPCACHE_DEBUG
+    fprintf(stderr, "bt::PixmapCache: depth %2u bpp %2u pad %2u\n",
+            format.depth, format.bits_per_pixel, format.scanline_pad);
+#endif // PIXMAPCACHE_DEBUG
+  }
+  if (list)
+    XFree(list);
+}
 
 
 bt::RealPixmapCache::~RealPixmapCache(void)
@@ -138,14 +270,29 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
   if (texture.texture() == Texture::Parent_Relative)
     return ParentRelative;
 
+  // textures that only change along one axis are cached as a strip
+  const unsigned int full_w = width, full_h = height;
+  texture.tileSize(width, height);
+
+  /*
+    solid textures are only cached when they shrink to a tile (flat,
+    interlaced, no border width).  drawTexture() draws all others
+    directly, including their bevels and borders.
+  */
+  if ((texture.texture() & Texture::Solid)
+      && width == full_w && height == full_h)
+    return None;
+
   Pixmap p;
   // find one in the cache
   CacheItem item(screen, texture, width, height);
-  Cache::iterator it = std::find(cache.begin(), cache.end(), item);
+  Cache::iterator it;
 
-  if (it != cache.end()) {
+  if (items.find(item.hash, ItemMatch(item), it)) {
     // found
+    ++stats.hits;
     ++(it->count);
+    cache.splice(cache.begin(), cache, it);
 
     p = it->pixmap;
 
@@ -154,10 +301,24 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
             it->pixmap, width, height, it->count);
 #endif // PIXMAPCACHE_DEBUG
   } else {
-    Image image(width, height);
-    p = image.render(_display, screen, texture);
+    ++stats.misses;
+
+    ::timeval start, end;
+    gettimeofday(&start, 0);
+
+    if (texture.texture() & Texture::Solid) {
+      p = renderSolidTile(screen, texture, width, height);
+    } else {
+      Image image(width, height);
+      p = image.render(_display, screen, texture);
+    }
+
+    gettimeofday(&end, 0);
+    stats.render_time += ((end.tv_sec - start.tv_sec) * 1000000l
+                          + (end.tv_usec - start.tv_usec));
 
     if (p) {
+      ++stats.renders;
       item.pixmap = p;
 
 #ifdef PIXMAPCACHE_DEBUG
@@ -168,13 +329,14 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
 #endif // PIXMAPCACHE_DEBUG
 
       cache.push_front(item);
+      items.insert(item.hash, cache.begin());
+      pixmaps.insert(hashPixmap(p), cache.begin());
 
       // keep track of memory usage server side
-      const unsigned long mem =
-        ( ( width * height ) * (_display.screenInfo(screen).depth() / 8 ) );
-      mem_usage += mem;
+      mem_usage += pixmapSize(screen, width, height);
+      stats.peak_usage = std::max(stats.peak_usage, mem_usage);
       if (mem_usage > maxmem_usage)
-        clear(false);
+        evict();
 
 #ifdef PIXMAPCACHE_DEBUG
       if (mem_usage > maxmem_usage) {
@@ -191,16 +353,105 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
 }
 
 
+unsigned long bt::RealPixmapCache::pixmapSize(unsigned int screen,
+                                              unsigned int width,
+                                              unsigned int height) const {
+  const unsigned int depth = _display.screenInfo(screen).depth();
+
+  // in case the depth is not listed
+  unsigned long bpp = (depth > 16) ? 32 : ((depth > 8) ? 16 : 8), pad = 32;
+  std::vector<PixmapFormat>::const_iterator it = formats.begin(),
+                                           end = formats.end();
+  for (; it != end; ++it) {
+    if (it->depth != depth)
+      continue;
+    bpp = it->bits_per_pixel;
+    pad = it->scanline_pad;
+    break;
+  }
+
+  const unsigned long bits = static_cast<unsigned long>(width) * bpp;
+  const unsigned long bytes_per_line = ((bits + pad - 1) / pad) * pad / 8;
+  return bytes_per_line * height;
+}
+
+
+unsigned long bt::RealPixmapCache::hashItem(unsigned int screen,
+                                            const Texture &texture,
+                                            unsigned int width,
+                                            unsigned int height) {
+  /*
+    hashes the same fields that Texture::operator==() compares, except
+    for the light and shadow colors, which are computed from color1
+  */
+  const Color * const colors[] = {
+    &texture.color1(), &texture.color2(), &texture.borderColor()
+  };
+  unsigned long hash = texture.texture();
+  hash = (hash * 31ul) + texture.borderWidth();
+  for (unsigned int i = 0; i < 3; ++i) {
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->red());
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->green());
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->blue());
+  }
+  hash = (hash * 31ul) + screen;
+  hash = (hash * 31ul) + width;
+  hash = (hash * 31ul) + height;
+  // mix the high bits into the low bits used to pick a bucket
+  hash *= 2654435761ul;
+  return hash ^ (hash >> 16);
+}
+
+
+/*
+  Renders the tile for flat, interlaced solid textures.  drawTexture()
+  draws the interlace lines in color2 on the even rows.
+*/
+Pixmap bt::RealPixmapCache::renderSolidTile(unsigned int screen,
+                                            const Texture &texture,
+                                            unsigned int width,
+                                            unsigned int height) {
+  if (!(texture.texture() & Texture::Interlaced))
+    return None;
+
+  // bevels and borders cannot be tiled, see find()
+  assert(!(texture.texture() & (Texture::Raised
+                                | Texture::Sunken
+                                | Texture::Border))
+         && texture.borderWidth() == 0);
+  assert(width <= 1u && height <= 2u);
+
+  const ScreenInfo &screeninfo = _display.screenInfo(screen);
+  Pixmap pixmap = XCreatePixmap(_display.XDisplay(), screeninfo.rootWindow(),
+                                width, height, screeninfo.depth());
+  if (pixmap == None)
+    return None;
+
+  Pen pen(screen, texture.color1());
+  Pen peninterlace(screen, texture.color2());
+  for (unsigned int y = 0; y < height; ++y) {
+    const Pen &p = (y & 1) ? pen : peninterlace;
+    XDrawLine(p.XDisplay(), pixmap, p.gc(), 0, y, width - 1, y);
+  }
+
+  return pixmap;
+}
+
+
 void bt::RealPixmapCache::release(Pixmap pixmap) {
   if (!pixmap || pixmap == ParentRelative)
     return;
 
-  Cache::iterator it = std::find_if(cache.begin(), cache.end(),
-                                    PixmapMatch(pixmap));
-  assert(it != cache.end() && it->count > 0);
+  Cache::iterator it;
+  const bool found = pixmaps.find(hashPixmap(pixmap), PixmapMatch(pixmap), it);
+  assert(found && it->count > 0);
+  (void) found;
 
   // decrement the refcount
-  --(it->count);
+  if (--(it->count) == 0) {
+    // unused pixmaps are evicted in the order they were last used
+    cache.splice(cache.begin(), cache, it);
+  }
 
 #ifdef PIXMAPCACHE_DEBUG
   fprintf(stderr, "bt::PixmapCache: rel %08lx %4ux%4u, count %4u\n",
@@ -230,31 +481,63 @@ void bt::RealPixmapCache::clear(bool force) {
       continue;
     }
 
+    it = remove(it);
+  }
+
 #ifdef PIXMAPCACHE_DEBUG
-    fprintf(stderr, "bt::PixmapCache: fre %08lx %4ux%4u\n",
-            it->pixmap, it->width, it->height);
+  fprintf(stderr,
+          "bt::PixmapCache: cleared, %u entries remain\n"
+          "                 mem %8lu max %8lu\n",
+          cache.size(), mem_usage, maxmem_usage);
 #endif // PIXMAPCACHE_DEBUG
+}
 
-    // keep track of memory usage server side
-    const unsigned long mem =
-      ( ( it->width * it->height ) *
-        (_display.screenInfo(it->screen).depth() / 8 ) );
-    assert(mem <= mem_usage);
-    mem_usage -= mem;
 
-    // free pixmap
-    XFreePixmap(_display.XDisplay(), it->pixmap);
+/*
+  Frees unused pixmaps, least recently used first, until the memory
+  usage is below 3/4 of the limit.  Stopping below the limit leaves
+  room for new pixmaps, instead of evicting one for every pixmap added.
+*/
+void bt::RealPixmapCache::evict(void) {
+  const unsigned long low_watermark = maxmem_usage / 4ul * 3ul;
 
-    // remove from cache
-    it = cache.erase(it);
+#ifdef PIXMAPCACHE_DEBUG
+  fprintf(stderr,
+          "bt::PixmapCache: evicting, %u entries\n"
+          "                 mem %8lu max %8lu low %8lu\n",
+          cache.size(), mem_usage, maxmem_usage, low_watermark);
+#endif // PIXMAPCACHE_DEBUG
+
+  Cache::iterator it = cache.end();
+  while (it != cache.begin() && mem_usage > low_watermark) {
+    --it;
+    if (it->count != 0)
+      continue;
+    it = remove(it);
+    ++stats.evictions;
   }
+}
 
+
+bt::RealPixmapCache::Cache::iterator
+bt::RealPixmapCache::remove(Cache::iterator it) {
 #ifdef PIXMAPCACHE_DEBUG
-  fprintf(stderr,
-          "bt::PixmapCache: cleared, %u entries remain\n"
-          "                 mem %8lu max %8lu\n",
-          cache.size(), mem_usage, maxmem_usage);
+  fprintf(stderr, "bt::PixmapCache: fre %08lx %4ux%4u\n",
+          it->pixmap, it->width, it->height);
 #endif // PIXMAPCACHE_DEBUG
+
+  // keep track of memory usage server side
+  const unsigned long mem = pixmapSize(it->screen, it->width, it->height);
+  assert(mem <= mem_usage);
+  mem_usage -= mem;
+
+  // free pixmap
+  XFreePixmap(_display.XDisplay(), it->pixmap);
+
+  // remove from cache
+  items.erase(it->hash, it);
+  pixmaps.erase(hashPixmap(it->pixmap), it);
+  return cache.erase(it);
 }
 
 
@@ -270,6 +553,10 @@ unsigned long bt::PixmapCache::memoryUsage(void)
 { return mem_usage / 1024; }
 
 
+bt::PixmapCache::Statistics bt::PixmapCache::statistics(void)
+{ return stats; }
+
+
 Pixmap bt::PixmapCache::find(unsigned int screen,
                              const Texture &texture,
                              unsigned int width, unsigned int height,
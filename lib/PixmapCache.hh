@@ -39,7 +39,8 @@ namespace bt {
       megabyte (1024 kilobytes).
 
       When this limit is reached, the cache will automatically free
-      unused pixmaps to reduce the amount of server side memory used.
+      unused pixmaps, least recently used first, until the amount of
+      server side memory used drops to 3/4 of the limit.
 
       NOTE: This limit is not a hard limit.  The cache will never free
       a pixmap that is in use.  This means it is possible that the
@@ -54,10 +55,35 @@ namespace bt {
 
     /*
       Returns the current amount of memory in kilobytes used by the X
-      server for the pixmaps in the cache.
+      server for the pixmaps in the cache.  This is computed from the
+      bits per pixel and scanline padding the X server uses for pixmaps
+      of the screen's depth.
     */
     static unsigned long memoryUsage(void);
 
+    /*
+      Statistics collected since the cache was created.
+    */
+    struct Statistics {
+      // calls to find() that returned a cached pixmap
+      unsigned long hits;
+      // calls to find() that had to render a pixmap
+      unsigned long misses;
+      // pixmaps successfully rendered
+      unsigned long renders;
+      // total time spent rendering, in microseconds
+      unsigned long render_time;
+      // unused pixmaps freed to stay below the cache limit
+      unsigned long evictions;
+      // the highest memory usage, in bytes
+      unsigned long peak_usage;
+    };
+
+    /*
+      Returns the cache statistics.
+    */
+    static Statistics statistics(void);
+
     /*
       Returns a pixmap matching the specified texture and size on the
       specified screen.  The pixmap will be rendered if necessary.
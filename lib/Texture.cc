@@ -128,6 +128,25 @@ bt::Texture& bt::Texture::operator=(const bt::Texture &tt) {
 }
 
 
+void bt::Texture::tileSize(unsigned int &width, unsigned int &height) const {
+  if (t & (bt::Texture::Raised | bt::Texture::Sunken | bt::Texture::Border))
+    return; // bevels and borders are drawn along every edge
+
+  if (t & bt::Texture::Gradient) {
+    if (t & bt::Texture::Vertical) {
+      width = std::min(width, 1u);
+    } else if (t & bt::Texture::Horizontal) {
+      height = std::min(height, (t & bt::Texture::Interlaced) ? 2u : 1u);
+    }
+  } else if ((t & bt::Texture::Solid) && (t & bt::Texture::Interlaced)
+             && bw == 0) {
+    // see drawTexture() below
+    width = std::min(width, 1u);
+    height = std::min(height, 2u);
+  }
+}
+
+
 bt::Texture bt::textureResource(const Display &display,
                                 unsigned int screen,
                                 const bt::Resource &resource,
@@ -220,10 +239,34 @@ void bt::drawTexture(unsigned int screen,
                      Pixmap pixmap) {
   Pen pen(screen, texture.color1());
 
-  if ((texture.texture() & Texture::Gradient) && pixmap) {
-    XCopyArea(pen.XDisplay(), pixmap, drawable, pen.gc(),
-              urect.x() - trect.x(), urect.y() - trect.y(),
-              urect.width(), urect.height(), urect.x(), urect.y());
+  unsigned int tile_w = trect.width(), tile_h = trect.height();
+  texture.tileSize(tile_w, tile_h);
+  const bool tiled = tile_w < trect.width() || tile_h < trect.height();
+
+  /*
+    solid textures only have a pixmap when they can be tiled;
+    everything else, bevels and borders included, is drawn below
+  */
+  if (pixmap && ((texture.texture() & Texture::Gradient)
+                 || ((texture.texture() & Texture::Solid)
+                     && pixmap != ParentRelative && tiled))) {
+    if (tiled) {
+      /*
+        the pixmap is a strip, let the X server tile it.  the GC is
+        shared (see Pen), so the fill style is restored afterwards;
+        the tile itself stays set, but strips are small
+      */
+      XSetTile(pen.XDisplay(), pen.gc(), pixmap);
+      XSetTSOrigin(pen.XDisplay(), pen.gc(), trect.x(), trect.y());
+      XSetFillStyle(pen.XDisplay(), pen.gc(), FillTiled);
+      XFillRectangle(pen.XDisplay(), drawable, pen.gc(),
+                     urect.x(), urect.y(), urect.width(), urect.height());
+      XSetFillStyle(pen.XDisplay(), pen.gc(), FillSolid);
+    } else {
+      XCopyArea(pen.XDisplay(), pixmap, drawable, pen.gc(),
+                urect.x() - trect.x(), urect.y() - trect.y(),
+                urect.width(), urect.height(), urect.x(), urect.y());
+    }
     return;
   } else if (!(texture.texture() & Texture::Solid)) {
     XClearArea(pen.XDisplay(), drawable,
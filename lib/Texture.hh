@@ -134,6 +134,15 @@ namespace bt {
     inline void setBorderWidth(unsigned int new_bw)
     { bw = new_bw; }
 
+    /*
+      Reduces width and height to the size of the tile needed to draw
+      the texture at that size.  Flat textures that only change along
+      one axis can be drawn by tiling a strip that is 1 pixel wide or
+      tall (2 tall when interlaced), which does not depend on the size
+      along the other axis.  All other textures need the full size.
+    */
+    void tileSize(unsigned int &width, unsigned int &height) const;
+
     Texture &operator=(const Texture &tt);
     inline bool operator==(const Texture &tt) const {
       return (c1 == tt.c1 && c2 == tt.c2 && bc == tt.bc &&
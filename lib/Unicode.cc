@@ -25,7 +25,9 @@
 #include "Unicode.hh"
 
 #include <algorithm>
+#include <map>
 
+#include <ctype.h>
 #include <errno.h>
 #include <iconv.h>
 #include <locale.h>
@@ -39,51 +41,62 @@
 #  include <langinfo.h>
 #endif
 
+#ifdef    SIMD
+#  include <emmintrin.h>
+#endif // SIMD
+
 
 namespace bt {
 
   static const iconv_t invalid = reinterpret_cast<iconv_t>(-1);
   static std::string codeset;
-
-  static unsigned int byte_swap(unsigned int c) {
-    wchar_t ret;
-    int x = sizeof(wchar_t);
-    char *s = reinterpret_cast<char *>(&c);
-    char *d = reinterpret_cast<char *>(&ret) + x - 1;
-    while (x-- > 0)
-      *d-- = *s++;
-    return ret;
+  static bool utf8_locale = false;
+
+  /*
+    UTF-32 in host byte order, so that iconv neither writes nor
+    expects a byte order mark.
+  */
+  static const char *utf32(void) {
+    const unsigned int one = 1u;
+    return (*reinterpret_cast<const unsigned char *>(&one)
+            ? "UTF-32LE"
+            : "UTF-32BE");
   }
 
-  static ustring native_endian(const ustring &string) {
-    if (string.empty())
-      return string;
-    if (*string.begin() == 0x0000feff) {
-      // begins with BOM in native endian
-      return ustring(string.begin() + 1, string.end());
-    } else if (*string.begin() == 0xfffe0000) {
-      // BOM is byte swapped, convert to native endian
-      ustring ret = ustring(string.begin() + 1, string.end());
-      ustring::iterator it = ret.begin();
-      const ustring::iterator end = ret.end();
-      for (; it != end; ++it)
-        *it = byte_swap(*it);
-      return ret;
-    } else {
-      return string;
+  static bool is_utf8(const std::string &name) {
+    std::string n;
+    for (std::string::size_type i = 0; i < name.size(); ++i) {
+      if (name[i] != '-' && name[i] != '_')
+        n += toupper(name[i]);
     }
+    return n == "UTF8";
   }
 
-  static ustring add_bom(const ustring &string) {
-    ustring ret;
-    ret.push_back(0x0000feff);
-    return ret + string;
+  /*
+    iconv descriptors are opened once per pair of codesets and kept
+    for the life of the process.  The conversion state is reset before
+    each use.
+  */
+  static iconv_t converter(const char *target, const char *source) {
+    typedef std::map<std::pair<std::string, std::string>, iconv_t>
+      Converters;
+    static Converters converters;
+
+    const Converters::key_type key(target, source);
+    Converters::iterator it = converters.find(key);
+    if (it == converters.end()) {
+      const iconv_t cd = iconv_open(target, source);
+      it = converters.insert(Converters::value_type(key, cd)).first;
+    } else if (it->second != invalid) {
+      iconv(it->second, 0, 0, 0, 0);
+    }
+    return it->second;
   }
 
   template <typename _Source, typename _Target>
   static void convert(const char *target, const char *source,
                       const _Source &in, _Target &out) {
-    iconv_t cd = iconv_open(target, source);
+    iconv_t cd = converter(target, source);
     if (cd == invalid)
       return;
 
@@ -125,7 +138,7 @@ namespace bt {
             // POSIX compliant iconv(3)
             inp =
               reinterpret_cast<char *>
-              (const_cast<typename _Source::value_type *>(in.data()));
+              (const_cast<typename _Source::value_type *>(in.data())) + off;
 #endif
             in_bytes = in_size - off;
             break;
@@ -145,14 +158,197 @@ namespace bt {
         default:
           perror("iconv");
           out = _Target();
-          iconv_close(cd);
           return;
         }
       }
     } while (in_bytes != 0);
 
     out.resize((out_size - out_bytes) / sizeof(typename _Target::value_type));
-    iconv_close(cd);
+  }
+
+#ifdef SIMD
+  /*
+    SSE2 ASCII runs, 16 characters per iteration.  Both return the
+    number of characters converted, stopping before the first block
+    that has a non-ASCII character.
+  */
+#define SSE2 __attribute__((target("sse2")))
+
+  static bool has_sse2(void) {
+    static const bool sse2 = __builtin_cpu_supports("sse2");
+    return sse2;
+  }
+
+
+  SSE2 static size_t sse2_widen_ascii(const unsigned char *p, size_t count,
+                                      Uchar *o) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + x));
+      if (_mm_movemask_epi8(v) != 0)
+        break;
+
+      const __m128i lo = _mm_unpacklo_epi8(v, zero);
+      const __m128i hi = _mm_unpackhi_epi8(v, zero);
+      __m128i * const d = reinterpret_cast<__m128i *>(o + x);
+      _mm_storeu_si128(d + 0, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+    return x;
+  }
+
+
+  SSE2 static size_t sse2_narrow_ascii(const Uchar *p, size_t count,
+                                       unsigned char *o) {
+    const __m128i mask = _mm_set1_epi32(~0x7f);
+    const __m128i zero = _mm_setzero_si128();
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+      const __m128i * const s = reinterpret_cast<const __m128i *>(p + x);
+      const __m128i a = _mm_loadu_si128(s + 0);
+      const __m128i b = _mm_loadu_si128(s + 1);
+      const __m128i c = _mm_loadu_si128(s + 2);
+      const __m128i d = _mm_loadu_si128(s + 3);
+      const __m128i high =
+        _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+                      mask);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(high, zero)) != 0xffff)
+        break;
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(o + x),
+                       _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                        _mm_packs_epi32(c, d)));
+    }
+    return x;
+  }
+
+#undef SSE2
+#endif // SIMD
+
+  /*
+    UTF-8 to UTF-32.  Malformed sequences, overlong forms, surrogates
+    and values beyond U+10FFFF are skipped one byte at a time, like
+    the iconv path does for invalid input.
+  */
+  static void decode_utf8(const std::string &in, ustring &out) {
+    out.resize(in.size()); // never more characters than bytes
+    if (in.empty())
+      return;
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in.data());
+    const unsigned char * const end = p + in.size();
+    Uchar * const begin = &out[0];
+    Uchar *o = begin;
+
+    while (p < end) {
+      const unsigned int c = *p;
+      if (c < 0x80) {
+#ifdef SIMD
+        if (has_sse2()) {
+          const size_t n = sse2_widen_ascii(p, end - p, o);
+          if (n > 0) {
+            p += n;
+            o += n;
+            continue;
+          }
+        }
+#endif // SIMD
+        *o++ = c;
+        ++p;
+        continue;
+      }
+
+      unsigned int len;
+      Uchar cp, min;
+      if ((c & 0xe0) == 0xc0) {
+        len = 2;
+        cp = c & 0x1f;
+        min = 0x80;
+      } else if ((c & 0xf0) == 0xe0) {
+        len = 3;
+        cp = c & 0x0f;
+        min = 0x800;
+      } else if ((c & 0xf8) == 0xf0) {
+        len = 4;
+        cp = c & 0x07;
+        min = 0x10000;
+      } else {
+        ++p;
+        continue;
+      }
+
+      if (static_cast<size_t>(end - p) < len) {
+        ++p;
+        continue;
+      }
+
+      unsigned int i = 1;
+      for (; i < len && (p[i] & 0xc0) == 0x80; ++i)
+        cp = (cp << 6) | (p[i] & 0x3f);
+      if (i < len || cp < min || cp > 0x10ffff
+          || (cp >= 0xd800 && cp <= 0xdfff)) {
+        ++p;
+        continue;
+      }
+
+      *o++ = cp;
+      p += len;
+    }
+
+    out.resize(o - begin);
+  }
+
+  /*
+    UTF-32 to UTF-8.  Surrogates and values beyond U+10FFFF are
+    skipped.
+  */
+  static void encode_utf8(const ustring &in, std::string &out) {
+    out.resize(in.size() * 4);
+    if (in.empty())
+      return;
+
+    const Uchar *p = in.data();
+    const Uchar * const end = p + in.size();
+    unsigned char * const begin = reinterpret_cast<unsigned char *>(&out[0]);
+    unsigned char *o = begin;
+
+    while (p < end) {
+      const Uchar c = *p;
+      if (c < 0x80) {
+#ifdef SIMD
+        if (has_sse2()) {
+          const size_t n = sse2_narrow_ascii(p, end - p, o);
+          if (n > 0) {
+            p += n;
+            o += n;
+            continue;
+          }
+        }
+#endif // SIMD
+        *o++ = c;
+      } else if (c < 0x800) {
+        *o++ = 0xc0 | (c >> 6);
+        *o++ = 0x80 | (c & 0x3f);
+      } else if (c < 0x10000) {
+        if (c < 0xd800 || c > 0xdfff) {
+          *o++ = 0xe0 | (c >> 12);
+          *o++ = 0x80 | ((c >> 6) & 0x3f);
+          *o++ = 0x80 | (c & 0x3f);
+        }
+      } else if (c <= 0x10ffff) {
+        *o++ = 0xf0 | (c >> 18);
+        *o++ = 0x80 | ((c >> 12) & 0x3f);
+        *o++ = 0x80 | ((c >> 6) & 0x3f);
+        *o++ = 0x80 | (c & 0x3f);
+      }
+      ++p;
+    }
+
+    out.resize(o - begin);
   }
 
 } // namespace bt
@@ -182,26 +378,12 @@ bool bt::hasUnicode() {
   }
 #endif // HAVE_NL_LANGINFO
 
-  struct {
-    const char *to;
-    const char *from;
-  } conversions[] = {
-    { "UTF-32", codeset.c_str() },
-    { "UTF-32", "UTF-8" },
-    { "UTF-8", "UTF-32" },
-    { codeset.c_str(), "UTF-32" },
-  };
-  static const int conversions_count = 4;
-
-  for (int x = 0; x < conversions_count; ++x) {
-    iconv_t cd = iconv_open(conversions[x].to, conversions[x].from);
-
-    if (cd == invalid) {
+  // UTF-8 locales use the built-in codecs, everything else needs iconv
+  utf8_locale = is_utf8(codeset);
+  if (!utf8_locale) {
+    if (converter(utf32(), codeset.c_str()) == invalid
+        || converter(codeset.c_str(), utf32()) == invalid)
       has_unicode = false;
-      break;
-    }
-
-    iconv_close(cd);
   }
 
   done = true;
@@ -216,9 +398,13 @@ bt::ustring bt::toUnicode(const std::string &string) {
     std::copy(string.begin(), string.end(), ret.begin());
     return ret;
   }
+  if (utf8_locale) {
+    decode_utf8(string, ret);
+    return ret;
+  }
   ret.reserve(string.size());
-  convert("UTF-32", codeset.c_str(), string, ret);
-  return native_endian(ret);
+  convert(utf32(), codeset.c_str(), string, ret);
+  return ret;
 }
 
 std::string bt::toLocale(const bt::ustring &string) {
@@ -229,25 +415,23 @@ std::string bt::toLocale(const bt::ustring &string) {
     std::copy(string.begin(), string.end(), ret.begin());
     return ret;
   }
+  if (utf8_locale) {
+    encode_utf8(string, ret);
+    return ret;
+  }
   ret.reserve(string.size());
-  convert(codeset.c_str(), "UTF-32", add_bom(string), ret);
+  convert(codeset.c_str(), utf32(), string, ret);
   return ret;
 }
 
 std::string bt::toUtf8(const bt::ustring &utf32) {
   std::string ret;
-  if (!hasUnicode())
-    return ret;
-  ret.reserve(utf32.size());
-  convert("UTF-8", "UTF-32", add_bom(utf32), ret);
+  encode_utf8(utf32, ret);
   return ret;
 }
 
 bt::ustring bt::toUtf32(const std::string &utf8) {
   ustring ret;
-  if (!hasUnicode())
-    return ret;
-  ret.reserve(utf8.size());
-  convert("UTF-32", "UTF-8", utf8, ret);
-  return native_endian(ret);
+  decode_utf8(utf8, ret);
+  return ret;
 }
@@ -67,6 +67,24 @@ void BlackboxResource::load(Blackbox& blackbox) {
   if (maxcolors != ~0u)
     bt::Image::setMaximumColors(maxcolors);
 
+  unsigned int threshold = res.read("session.renderThreshold",
+                                    "Session.RenderThreshold",
+                                    ~0u);
+  if (threshold != ~0u)
+    bt::Image::setRenderThreshold(threshold);
+
+  threshold = res.read("session.imageCacheThreshold",
+                       "Session.ImageCacheThreshold",
+                       ~0u);
+  if (threshold != ~0u)
+    bt::Image::setCacheThreshold(threshold);
+
+  unsigned int cachesize = res.read("session.imageCacheSize",
+                                    "Session.ImageCacheSize",
+                                    ~0u);
+  if (cachesize != ~0u)
+    bt::Image::setCacheSize(cachesize);
+
   double_click_interval = res.read("session.doubleClickInterval",
                                    "Session.DoubleClickInterval",
                                    250l);
@@ -249,6 +267,12 @@ void BlackboxResource::save(Blackbox& blackbox) {
 
   res.write("session.maximumColors",  bt::Image::maximumColors());
 
+  res.write("session.renderThreshold", bt::Image::renderThreshold());
+
+  res.write("session.imageCacheThreshold", bt::Image::cacheThreshold());
+
+  res.write("session.imageCacheSize", bt::Image::cacheSize());
+
   res.write("session.doubleClickInterval", double_click_interval);
 
   res.write("session.autoRaiseDelay", ((auto_raise_delay.tv_sec * 1000ul) +
@@ -463,9 +463,10 @@ void Toolbar::redrawClockLabel(void) {
   if (! strftime(str, sizeof(str), options.strftime_format.c_str(), tt))
     return; // ditto
 
-  bt::Pen pen(_screen->screenNumber(), style.clock_text);
-  bt::drawText(style.font, pen, frame.clock, u, style.alignment,
-               bt::toUnicode(str));
+  frame.clock_layout.update(_screen->screenNumber(), style.font,
+                            style.clock_text, u, style.alignment,
+                            bt::toUnicode(str));
+  frame.clock_layout.draw(frame.clock);
 }
 
 
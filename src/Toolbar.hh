@@ -46,6 +46,7 @@ private:
     int y_hidden;
     bt::Rect rect, slabel_rect, wlabel_rect, clock_rect, ps_rect, ns_rect,
       pw_rect, nw_rect;
+    bt::TextLayout clock_layout;
   } frame;
 
   Blackbox *blackbox;
@@ -33,6 +33,7 @@
 #include "Workspace.hh"
 #include "blackbox.hh"
 
+#include <Image.hh>
 #include <Pen.hh>
 #include <PixmapCache.hh>
 #include <Unicode.hh>
@@ -1235,6 +1236,8 @@ BlackboxWindow::~BlackboxWindow(void) {
     _screen->hideGeometry();
     XUngrabPointer(blackbox->XDisplay(), blackbox->XTime());
   }
+  if (client.state.resizing)
+    bt::Image::setCacheWrites(true);
 
   delete timer;
 
@@ -2767,16 +2770,16 @@ void BlackboxWindow::redrawLabel(void) const {
                     frame.label, u, u, p);
   }
 
-  const bt::Pen pen(_screen->screenNumber(),
-                    ((client.state.focused)
-                     ? style.focus.text
-                     : style.unfocus.text));
   u.setCoords(u.left()  + style.label_margin,
               u.top() + style.label_margin,
               u.right() - style.label_margin,
               u.bottom() - style.label_margin);
-  bt::drawText(style.font, pen, frame.label, u,
-               style.alignment, client.visible_title);
+  frame.label_layout.update(_screen->screenNumber(), style.font,
+                            ((client.state.focused)
+                             ? style.focus.text
+                             : style.unfocus.text),
+                            u, style.alignment, client.visible_title);
+  frame.label_layout.draw(frame.label);
 }
 
 
@@ -3911,6 +3914,8 @@ void BlackboxWindow::startResize(Window window) {
                GrabModeAsync, GrabModeAsync, None, cursor, blackbox->XTime());
 
   client.state.resizing = true;
+  // the sizes in between are not worth keeping in the image cache
+  bt::Image::setCacheWrites(false);
 
   frame.changing = constrain(frame.rect, frame.margin, client.wmnormal,
                              Corner(frame.corner));
@@ -4051,6 +4056,7 @@ void BlackboxWindow::finishResize() {
   }
 
   client.state.resizing = false;
+  bt::Image::setCacheWrites(true);
 
   XUngrabPointer(blackbox->XDisplay(), blackbox->XTime());
 
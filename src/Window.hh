@@ -217,6 +217,7 @@ class BlackboxWindow : public StackEntity, public bt::TimeoutHandler,
     int grab_x, grab_y;         // where was the window when it was grabbed?
 
     unsigned int label_w;       // width of the label
+    mutable bt::TextLayout label_layout;
   } frame;
 
   Window createToplevelWindow();
@@ -373,6 +373,7 @@ void Blackbox::timeout(bt::Timer *) {
 
   bt::Color::clearCache();
   bt::Font::clearCache();
+  bt::Pen::clearCache();
   bt::PixmapCache::clearCache();
 }
 